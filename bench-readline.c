@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "readline.h"
+
+//
+// bench-readline.c - Benchmark readline's keystroke hot path
+//
+//     Replays scripted keystroke traces through readline() with no
+//     terminal: keys come from memory, and the ANSI output is counted
+//     and thrown away. Prints one JSON object per trace, e.g.
+//
+//         {"trace":"typing","keys":2700,"lines":50,"ns_per_key":72.1,
+//          "bytes_per_key":2.46,"redraws_per_line":55.00}
+//
+//     ..so runs can be diffed between commits.
+//
+//     Usage: bench-readline [reps]
+//
+
+// A keystroke trace: each key is what one read() of the tty returns
+typedef struct {
+    const char *name;
+    char *bytes;        // all keys, back to back
+    long nbytes;
+    long size;
+    int *keylen;        // bytes in each key
+    int nkeys;
+    int keysize;
+    int lines;          // lines the trace ENTERs
+    int histlines;      // lines of history to preload
+} Trace;
+
+// Replay state
+static Trace *cur;      // trace being replayed
+static long  curbyte;   // next byte of it
+static int   curkey;    // next key of it
+static int   curoff;    // bytes of that key already read
+static long  outbytes;  // bytes readline sent the terminal
+static long  flushes;   // frames (one flush per redraw)
+
+// ADD ONE KEY OF 'n' BYTES TO TRACE
+static void key(Trace *t, const char *s, int n)
+{
+    if ( t->nbytes + n > t->size ) {
+        t->size  = (t->nbytes + n) * 2;
+        t->bytes = (char*)realloc(t->bytes, t->size);
+    }
+    if ( t->nkeys == t->keysize ) {
+        t->keysize = t->keysize ? t->keysize * 2 : 256;
+        t->keylen  = (int*)realloc(t->keylen, sizeof(int) * t->keysize);
+    }
+    memcpy(t->bytes + t->nbytes, s, n);
+    t->nbytes += n;
+    t->keylen[t->nkeys++] = n;
+    if ( n == 1 && s[0] == '\r' ) ++t->lines;
+}
+
+// ADD A KEY GIVEN AS A STRING (e.g. an ESC sequence)
+static void keys(Trace *t, const char *s)
+{
+    key(t, s, strlen(s));
+}
+
+// TYPE STRING 's', ONE KEY PER CHAR
+static void type(Trace *t, const char *s)
+{
+    for ( ; *s; s++ ) key(t, s, 1);
+}
+
+// BENCH READ: RETURN NEXT KEY OF THE TRACE
+static int bench_read(Readline *rs, char *buf, int size, int timeout)
+{
+    int n;
+    rs = rs;                                    // unused
+    if ( curkey >= cur->nkeys )                 // ran out? shouldn't happen
+        return timeout >= 0 ? 0 : RL_READ_EOF;
+    n = cur->keylen[curkey] - curoff;
+    if ( n > size ) {                           // bigger than a read; split
+        memcpy(buf, cur->bytes + curbyte, size);
+        curbyte += size;
+        curoff  += size;
+        return size;
+    }
+    memcpy(buf, cur->bytes + curbyte, n);
+    curbyte += n;
+    curoff   = 0;
+    ++curkey;
+    return n;
+}
+
+// BENCH FLUSH: COUNT THE FRAME'S BYTES, DON'T SEND THEM
+static void bench_flush(Readline *rs)
+{
+    outbytes += rs->outlen;
+    rs->outlen = 0;
+    ++flushes;
+}
+
+// MAKE THE TRACES
+static int make_traces(Trace *t)
+{
+    char line[512];
+    int i, j, n = 0;
+
+    // Typing: short commands, with the odd typo fixed
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "typing";
+    for ( i=0; i<50; i++ ) {
+        sprintf(line, "copy c:\\data\\file%03d.txt d:\\backup\\file%03d.bak /v", i, i);
+        type(&t[n], line);
+        key(&t[n], "\b", 1); key(&t[n], "\b", 1);
+        type(&t[n], "/y");
+        key(&t[n], "\r", 1);
+    }
+    n++;
+
+    // Paste: 2KB commands in one bracketed paste
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "paste";
+    for ( i=0; i<20; i++ ) {
+        char *p = (char*)malloc(2100);
+        strcpy(p, "\033[200~");
+        for ( j=0; j<2000; j++ ) p[6+j] = "abcdefgh ijklmnop "[j % 18];
+        strcpy(p + 2006, "\033[201~");
+        keys(&t[n], p);
+        key(&t[n], "\r", 1);
+        free(p);
+    }
+    n++;
+
+    // History: walk up and down a big history, search it
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "history";
+    t[n].histlines = 1000;
+    for ( i=0; i<20; i++ ) {
+        for ( j=0; j<30; j++ ) keys(&t[n], "\033[A");
+        for ( j=0; j<10; j++ ) keys(&t[n], "\033[B");
+        keys(&t[n], "\033[1;5A");               // top
+        keys(&t[n], "\033[1;5B");               // bottom
+        key(&t[n], "\022", 1);                  // ^R
+        sprintf(line, "%d", 900 + i);
+        type(&t[n], line);
+        key(&t[n], "\022", 1);                  // older match
+        key(&t[n], "\r", 1);
+    }
+    n++;
+
+    // Word motion: hop around a long line, editing mid-line
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "words";
+    for ( i=0; i<20; i++ ) {
+        type(&t[n], "the quick brown fox jumps over the lazy dog and keeps "
+                    "running across the field until the sun goes down again");
+        for ( j=0; j<12; j++ ) keys(&t[n], "\033[1;5D");
+        type(&t[n], "very ");
+        for ( j=0; j<6; j++ ) keys(&t[n], "\033[1;5C");
+        keys(&t[n], "\033[3~");
+        keys(&t[n], "\033[H");
+        type(&t[n], "# ");
+        keys(&t[n], "\033[F");
+        key(&t[n], "\r", 1);
+    }
+    n++;
+
+    // Tabs: lines wrapping the screen with tabs, edited at the start
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "tabs";
+    for ( i=0; i<20; i++ ) {
+        for ( j=0; j<40; j++ ) type(&t[n], (j & 1) ? "\tfield" : "\tx");
+        keys(&t[n], "\033[H");
+        for ( j=0; j<10; j++ ) type(&t[n], "y");
+        for ( j=0; j<10; j++ ) key(&t[n], "\004", 1);     // ^D
+        key(&t[n], "\r", 1);
+    }
+    n++;
+
+    // Long line: a 3KB paste with the odd tab, word hops, edits at the start
+    memset(&t[n], 0, sizeof(Trace)); t[n].name = "longline";
+    for ( i=0; i<20; i++ ) {
+        char *p = (char*)malloc(3100);
+        strcpy(p, "\033[200~");
+        for ( j=0; j<3000; j++ )
+            p[6+j] = ( j % 500 == 499 ) ? '\t' : "lorem ipsum dolor sit amet "[j % 27];
+        strcpy(p + 3006, "\033[201~");
+        keys(&t[n], p);
+        free(p);
+        for ( j=0; j<40; j++ ) keys(&t[n], "\033[1;5D");   // word left
+        for ( j=0; j<40; j++ ) keys(&t[n], "\033[1;5C");   // word right
+        keys(&t[n], "\033[H");
+        for ( j=0; j<10; j++ ) type(&t[n], "z");
+        key(&t[n], "\r", 1);
+    }
+    n++;
+
+    return n;
+}
+
+// NANOSECONDS NOW
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    Trace traces[8];
+    ReadlineTerm term;
+    int ntraces = make_traces(traces);
+    int reps = (argc > 1) ? atoi(argv[1]) : 20;
+    int i, r, l;
+    char hist[64];
+
+    // ANSI output, but keys from the trace and output counted
+    term       = *readline_term_ansi();
+    term.read  = bench_read;
+    term.flush = bench_flush;
+
+    for ( i=0; i<ntraces; i++ ) {
+        Trace *t = &traces[i];
+        double ns = 0, t0;
+        outbytes = flushes = 0;
+        for ( r=0; r<reps; r++ ) {
+            Readline *rs = MakeReadline(4096, 1000);
+            rs->term    = &term;
+            rs->prompt  = "C:\\> ";
+            rs->prompty = 12;
+            rs->keepraw = 1;                    // no tty mode switch per line
+            rs->termsize = 0;                   // 80x25, whatever the tty is
+            for ( l=0; l<t->histlines; l++ ) {
+                sprintf(hist, "cmd %d arg%d", l, l % 7);
+                readline_history_add(rs, hist);
+            }
+            cur = t; curbyte = 0; curkey = 0; curoff = 0;
+            t0 = now_ns();
+            for ( l=0; l<t->lines; l++ ) {
+                readline(rs);
+                rs->prompty = 12;               // like an app printing output
+            }
+            ns += now_ns() - t0;
+            FreeReadline(rs);
+        }
+        printf("{\"trace\":\"%s\",\"keys\":%d,\"lines\":%d,\"ns_per_key\":%.1f,"
+               "\"bytes_per_key\":%.2f,\"redraws_per_line\":%.2f}\n",
+               t->name, t->nkeys, t->lines,
+               ns / ((double)reps * t->nkeys),
+               (double)outbytes / ((double)reps * t->nkeys),
+               (double)flushes / ((double)reps * t->lines));
+        free((void*)t->bytes);                  // done with this trace
+        free((void*)t->keylen);
+    }
+    return 0;
+}
@@ -18,19 +18,82 @@
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <time.h>
 
 #ifdef LINUX
-#define kbhit() 1
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
 #else
 #include <dos.h>
 #include <conio.h>
 #endif
 
+// Vector scanning (see SCANNING): where the compiler has it, unless
+// -DREADLINE_NOSIMD
+#if defined(LINUX) && defined(__GNUC__) && !defined(READLINE_NOSIMD)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SCAN_SSE2               // 16 bytes at a time
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define SCAN_AVX2               // 32 bytes at a time
+#endif
+#endif
+
 #include "readline.h"
 
 #define MAX(x,y)               (((x)>(y))?(x):(y))
 #define MIN(x,y)               (((x)<(y))?(x):(y))
 
+// Stats counting: compiles to nothing unless -DREADLINE_STATS
+#ifdef READLINE_STATS
+#define STAT(rs,what,n)        ((rs)->stats.what += (n))
+#else
+#define STAT(rs,what,n)
+#endif
+
+#ifdef LINUX
+#define OUTBUF_SIZE 4096        // terminal output buffer size
+#define INBUF_SIZE  4096        // keyboard input buffer size
+#define SPAN_SIZE   256         // most cells sent in one put()
+#else
+#define OUTBUF_SIZE 256         // small; DOS plots cells into video ram
+#define INBUF_SIZE  64          // typeahead buffer size
+#define SPAN_SIZE   80          // most cells sent in one put()
+#endif
+
+#define HIST_AVGLINE 64         // default history arena bytes per line
+#define ESC_TIMEOUT  100        // default msecs to wait for rest of ESC key
+#define VIEW_MIN     10         // hscroll: fewest cells for line, else wrap
+#define LIST_ROWS    10         // most rows of completions listed at once
+#ifdef LINUX
+#define UNDO_BYTES   65536L     // most bytes of undo log (or 2*maxline)
+#else
+#define UNDO_BYTES   1024L
+#endif
+#ifdef LINUX
+#define KILL_BYTES   8192L      // size of kill ring (or maxline)
+#else
+#define KILL_BYTES   512L
+#endif
+
+#ifdef LINUX
+#define SRCH_BUCKETS 4096       // ^R search index: trigram hash buckets
+#else
+#define SRCH_BUCKETS 64         // (power of 2)
+#endif
+#ifndef LINUX
+#define HIST_MAXBYTES 65000L    // DOS: arena must fit one 64k malloc()
+#endif
+
 //
 // readline - A DOS 16 bit readline for low memory use DOS 16 bit apps
 //
@@ -40,6 +103,8 @@
 //
 //           Up Arrow -- previous line in command history      (^P)
 //           Dn Arrow -- next line in command history          (^N)
+//                       (if rs->histprefix is set, up/down only show
+//                       lines starting with the text before the cursor)
 //           Lt Arrow -- move reverse one char on current line (^B)
 //           Rt Arrow -- move forward one char on current line (^F)
 //          Backspace -- backspace and delete                  (^H)
@@ -50,11 +115,25 @@
 //         Ctrl-End   -- jump to bottom of command history (current line)
 //         Ctrl-Left  -- word left
 //         Ctrl-Right -- word right
-//              ^K    -- clear to end of line
-//              ^U    -- clear current line (and 'undo' clear if hit again)
+//              ^W    -- kill word left of cursor
+//         Ctrl-Del   -- kill word right of cursor                 (Alt-D)
+//              ^K    -- kill to end of line (and 'undo' kill if hit again)
+//              ^U    -- kill to start of line (and 'undo' kill if hit again)
+//              ^Y    -- yank back last text killed
+//              Alt-Y -- right after ^Y: swap it for the kill before, etc
 //              ^V    -- Enter literal next character (like VI)
+//              ^_    -- undo last edit (again: the one before, etc)
+//              ^^    -- redo edit undone
+//              TAB   -- complete word before cursor (TAB again: list choices,
+//                       a page at a time), if the app gave rs->complete or
+//                       readline_complete_add() candidates; else a tab char
+//              ^R    -- reverse search history as you type (^R again: older,
+//                       ^G: abort, other keys: accept and edit)
 //              ESC   -- clear current line (and 'undo' clear if hit again)
 //
+//     If rs->hscroll is set, long lines stay on the prompt's row and
+//     scroll sideways with the cursor, '<' and '>' showing there's more.
+//
 
 // C types
 typedef unsigned char   uchar;
@@ -62,507 +141,3560 @@ typedef unsigned short  ushort;
 typedef unsigned int    uint;
 typedef unsigned long   ulong;
 
+// Default key bindings
+typedef struct {
+    const char *seq;    // byte sequence
+    int len;            // bytes in seq
+    int key;            // key it's decoded as
+} RLBind;
+
+static RLBind default_keys[] = {
+#ifdef LINUX
+    { "\33",       1, 0x1b              },  // ESC
+    { "\33[A",     3, RL_KEY_UP         },  // UP ARROW
+    { "\33[B",     3, RL_KEY_DOWN       },  // DN ARROW
+    { "\33[C",     3, RL_KEY_RIGHT      },  // RT ARROW
+    { "\33[D",     3, RL_KEY_LEFT       },  // LT ARROW
+    { "\33[H",     3, RL_KEY_HOME       },  // HOME
+    { "\33[F",     3, RL_KEY_END        },  // END
+    { "\33OA",     3, RL_KEY_UP         },  // (keypad/application mode)
+    { "\33OB",     3, RL_KEY_DOWN       },
+    { "\33OC",     3, RL_KEY_RIGHT      },
+    { "\33OD",     3, RL_KEY_LEFT       },
+    { "\33OH",     3, RL_KEY_HOME       },
+    { "\33OF",     3, RL_KEY_END        },
+    { "\33[1~",    4, RL_KEY_HOME       },  // (linux console, screen)
+    { "\33[4~",    4, RL_KEY_END        },
+    { "\33[3~",    4, RL_KEY_DEL        },  // DEL
+    { "\33[1;5A",  6, RL_KEY_CTRL_UP    },  // CTRL-UP
+    { "\33[1;5B",  6, RL_KEY_CTRL_DOWN  },  // CTRL-DN
+    { "\33[1;5C",  6, RL_KEY_CTRL_RIGHT },  // CTRL-RT
+    { "\33[1;5D",  6, RL_KEY_CTRL_LEFT  },  // CTRL-LT
+    { "\33[3;5~",  6, RL_KEY_CTRL_DEL   },  // CTRL-DEL
+    { "\33d",      2, RL_KEY_ALT_D      },  // ALT-D
+    { "\33y",      2, RL_KEY_ALT_Y      },  // ALT-Y
+    { "\33[200~",  6, RL_KEY_PASTE_BEGIN},  // bracketed paste
+    { "\33[201~",  6, RL_KEY_PASTE_END  },
+#else
+    { "\0\x3d",    2, RL_KEY_F3         },  // F3
+    { "\0\x4b",    2, RL_KEY_LEFT       },  // LT ARROW
+    { "\0\x4d",    2, RL_KEY_RIGHT      },  // RT ARROW
+    { "\0\x48",    2, RL_KEY_UP         },  // UP ARROW
+    { "\0\x50",    2, RL_KEY_DOWN       },  // DN ARROW
+    { "\0\x47",    2, RL_KEY_HOME       },  // HOME
+    { "\0\x4f",    2, RL_KEY_END        },  // END
+    { "\0\x53",    2, RL_KEY_DEL        },  // DEL
+    { "\0\x8d",    2, RL_KEY_CTRL_UP    },  // CTRL-UP
+    { "\0\x91",    2, RL_KEY_CTRL_DOWN  },  // CTRL-DOWN
+    { "\0\x73",    2, RL_KEY_CTRL_LEFT  },  // CTRL-LT
+    { "\0\x74",    2, RL_KEY_CTRL_RIGHT },  // CTRL-RT
+    { "\0\x93",    2, RL_KEY_CTRL_DEL   },  // CTRL-DEL
+    { "\0\x20",    2, RL_KEY_ALT_D      },  // ALT-D
+    { "\0\x15",    2, RL_KEY_ALT_Y      },  // ALT-Y
+#endif
+    { 0, 0, 0 }
+};
+
 // CREATE A NEW Readline STRUCT
 Public Readline* MakeReadline(int maxline,     // max chars per line
                               int histsize)    // max history of lines
 {
-    int t;
     Readline *rs = (Readline*)malloc(sizeof(Readline));
+    int i;
     rs->maxline  = maxline;
     rs->histsize = histsize;
-    rs->history  = (char**)malloc(sizeof(char*) * histsize);
-    // Pre-allocate history, to prevent mem fragmentation
-    for ( t=0; t<histsize; t++ ) {
-        rs->history[t] = (char*)malloc(maxline); // alloc line
-        rs->history[t][0] = 0;                   // null terminate
-    }
-    rs->histsave= (char*)malloc(maxline);        // alloc line
-    rs->histsave[0] = 0;
-    rs->undoline= (char*)malloc(maxline);        // undo line
-    rs->undoline[0] = 0;
-    rs->undocurpos = 0;
+    // Pre-allocate history arena, to prevent mem fragmentation
+    //    Lines are packed in at their real length; the app can
+    //    change the byte budget with readline_history_budget().
+    //
+    rs->hbytes   = MAX((long)histsize * HIST_AVGLINE, 2L * maxline);
+#ifndef LINUX
+    rs->hbytes   = MIN(rs->hbytes, HIST_MAXBYTES);
+#endif
+    rs->harena   = (char*)malloc((size_t)rs->hbytes);
+    rs->htail    = 0;
+    rs->hused    = 0;
+    rs->hoff     = (long*)malloc(sizeof(long) * histsize);
+    rs->hlen     = (int*)malloc(sizeof(int) * histsize);
+    rs->histfile     = 0;   // no history file (caller can set)
+    rs->histfilemax  = 0;   // compact file past 2x arena size
+    rs->histfilesize = 0;
+    rs->searching = 0;  // ^R search: index built on first use
+    rs->srchidx   = 0;
+    rs->srchpat   = 0;
+    rs->srchprompt= 0;
+    rs->histnodups = 0; // keep duplicate lines (caller can set)
+    rs->hdup      = 0;  // duplicate hash built on first use
+    rs->histprefix = 0; // up/down visit all of history (caller can set)
+    rs->hsort     = 0;  // prefix index built on first use
+    rs->navmatch  = 0;
+    rs->navpfx    = 0;
+    rs->navprefix = 0;
+    rs->histfirst = 0;  // history ring empty
+    rs->histnext  = 0;
+    rs->histpos   = -1; // not navigating
+    rs->histbase  = -1;
+    rs->lineseq   = -1; // showing edit buffer
+    rs->editbuf = (char*)malloc(maxline);        // line being edited
+    rs->editbuf[0] = 0;
+    rs->editlen = 0;
+    rs->line    = rs->editbuf;
+    rs->ulog    = 0;    // undo log allocated on first edit
+    rs->ulogn   = 0;
+    rs->ulogsize = 0;
+    rs->utop    = 0;
+    rs->ubuf    = 0;
+    rs->ubytes  = 0;
+    rs->usize   = 0;
+    rs->ustep   = 0;
+    rs->ucur    = 0;
+    rs->utyped  = 0;
+    rs->killsize = MAX(KILL_BYTES, maxline);     // kill ring
+    rs->killbuf = (char*)malloc(rs->killsize);
+    rs->killused = 0;
+    rs->killn   = 0;
+    rs->killyank = 0;
+    rs->yankpos = 0;
+    rs->yanklen = 0;
+    rs->killkey = 0;
+    rs->yankkey = 0;
+    rs->linelen  = 0;   // gap buffer: empty line, all gap
+    rs->gapstart = 0;
+    rs->gapend   = maxline;
+    rs->linehigh = 0;   // (all ASCII)
+    rs->cols     = (int*)malloc(sizeof(int) * (maxline+1));
+    rs->colvalid = 0;   // layout cache empty
+    rs->dirty    = 0;
+    rs->layprompt = 0;
+    rs->hscroll  = 0;   // wrap long lines (caller can set)
+    rs->complete = 0;   // no completion (caller can set)
+    rs->compdata = 0;
+    rs->carena   = 0;   // candidate store empty
+    rs->cbytes   = 0;
+    rs->csize    = 0;
+    rs->cword    = 0;
+    rs->cwords   = 0;
+    rs->cwordsize = 0;
+    rs->csorted  = 1;
+    rs->compword = (char*)malloc(maxline);       // word being completed
+    rs->comptab  = 0;
+    rs->listing  = 0;
+    rs->viewstart = 0;
     rs->curpos  = 0;
     rs->promptx = 0;    // 0=first char, (scrn_w-1)=last char
-    rs->prompty = 23;   // 0=top line, (rs->scrn_h-1)=bottom line
+    rs->prompty = -1;   // 0=top line, (rs->scrn_h-1)=bottom line, -1=one up
+    rs->frametop = 0;   // (all of line on screen)
     rs->prompt  = "PROMPT>";  // can be redefined by caller
     rs->cursorx = 0;
     rs->cursory = 0;
     rs->literal = 0;
-    rs->scrn_w  = 80;   // can be redefined by caller
-    rs->scrn_h  = 25;   // can be redefined by caller
+    rs->keylen  = 0;    // no key codes partly in
+    rs->esctimeout = ESC_TIMEOUT;   // can be redefined by caller
+    rs->keytriesize = 64;           // key trie, grows as keys are bound
+    rs->keytrie  = (RLKeyNode*)malloc(sizeof(RLKeyNode) * rs->keytriesize);
+    rs->keynodes = 1;               // just the root
+    rs->keytrie[0].key   = -1;
+    rs->keytrie[0].child = 0;
+    for ( i=0; default_keys[i].seq; i++ )
+        readline_bind(rs, default_keys[i].seq, default_keys[i].len,
+                      default_keys[i].key);
+    rs->pasting = 0;
+    rs->inbuf   = (char*)malloc(INBUF_SIZE);     // typeahead buffer
+    rs->inlen   = 0;
+    rs->inpos   = 0;
+    rs->lineready = 0;
+    rs->scrn_w  = 80;   // until terminal says otherwise; caller can set
+    rs->scrn_h  = 25;   //    these if it clears termsize
+    rs->termsize  = 1;  // ask terminal its size..
+    rs->checksize = 1;  // ..when first line begins
+    rs->outbuf  = (char*)malloc(OUTBUF_SIZE);    // frame output buffer
+    rs->outsize = OUTBUF_SIZE;
+    rs->outlen  = 0;
+    rs->outx    = -1;   // terminal cursor position unknown
+    rs->outy    = -1;
+#ifdef LINUX
+    rs->term    = readline_term_ansi();     // can be redefined by caller
+#else
+    rs->term    = readline_term_dos();
+#endif
+    rs->termdata = 0;
+    rs->infd    = 0;    // stdin/stdout (can be redefined by caller)
+    rs->outfd   = 1;
+    rs->keepraw = 0;    // back to cooked mode after each line
+#ifdef LINUX
+    rs->utf8    = 1;    // terminals are UTF-8 (caller can clear)
+#else
+    rs->utf8    = 0;    // DOS: a byte is a char
+#endif
+    memset(&rs->stats, 0, sizeof(rs->stats));   // no stats yet
+    rs->span    = (char*)malloc(SPAN_SIZE);     // chars for next put()
+    rs->spanlen = 0;
+    rs->spancells = 0;
+    rs->framebytes = 0;
+    rs->shadowsize = maxline + 80;              // grows if tabs need more
+    rs->shadow  = (long*)malloc(sizeof(long) * rs->shadowsize);
+    rs->shadowlen = 0;  // nothing drawn yet
+    rs->drawnlen  = 0;
     return rs;
 }
 
 // FREE A Readline STRUCT
 Public void FreeReadline(Readline *rs)
 {
-    int t;
-    for ( t=0; t<rs->histsize; t++ ) {
-       free((void*)rs->history[t]);     // free history lines
-       rs->history[t] = 0;
+   free((void*)rs->harena);             // free history arena
+   free((void*)rs->hoff);               // free history index
+   free((void*)rs->hlen);
+   free((void*)rs->editbuf);            // free edit buffer
+   free((void*)rs->ulog);               // free undo log
+   free((void*)rs->ubuf);
+   free((void*)rs->killbuf);            // free kill ring
+   free((void*)rs->outbuf);             // free output buffer
+   free((void*)rs->span);
+   free((void*)rs->inbuf);              // free typeahead buffer
+   free((void*)rs->keytrie);            // free key decoder
+   free((void*)rs->shadow);             // free shadow screen
+   free((void*)rs->cols);               // free layout cache
+   free((void*)rs->hdup);               // free duplicate line hash
+   free((void*)rs->hsort);              // free prefix index
+   free((void*)rs->navmatch);
+   free((void*)rs->navpfx);
+   free((void*)rs->carena);             // free candidate store
+   free((void*)rs->cword);
+   free((void*)rs->compword);
+   readline_rawmode(rs, 0);             // leave raw mode, if we're in it
+   if ( rs->srchidx ) {                 // free search index
+       int t;
+       for ( t=0; t<SRCH_BUCKETS; t++ ) free((void*)rs->srchidx[t].seq);
+       free((void*)rs->srchidx);
+       free((void*)rs->srchpat);
+       free((void*)rs->srchprompt);
    }
-   free((void*)rs->history);            // free history array
-   free((void*)rs->histsave);           // free history save line
-   free((void*)rs->undoline);           // free undo buffer
    free((void*)rs);                     // free struct allocation
 }
 
-#ifdef LINUX
-Local char getch()
+////            /////////////////////////////////////////
+//// GAP BUFFER /////////////////////////////////////////
+////            /////////////////////////////////////////
+
+// The line being edited (rs->line) is kept as a gap buffer:
+//
+//     rs->line: [ line[0..gapstart-1] ][ ..gap.. ][ rest of line ]
+//                                       ^gapstart  ^gapend       ^maxline
+//
+// Edits happen at the gap, so insert/delete at the cursor only move
+// the text between the old and new gap position, not the whole line.
+// line_str() closes the gap when a contiguous string is needed.
+//
+// During history navigation rs->line points right at the history
+// entry being shown (gap at its end), so nothing is copied until
+// the user edits it; see line_edit().
+//
+
+// UNDO LOG
+//    Every change to the edit buffer is logged as a delta: at line
+//    position 'pos', 'del' chars were removed and 'ins' inserted. The
+//    chars themselves go in ubuf (removed ones, then inserted), so the
+//    log grows with what was edited, not with the line's size.
+//
+//    Deltas made by one key share a 'step' (a run of typed chars is one
+//    step too), and undo/redo take back or redo a step at a time.
+//    ulog[0..utop-1] are in effect; ulog[utop..ulogn-1] were undone,
+//    and can be redone until the next edit. Past UNDO_BYTES, the
+//    oldest steps are forgotten.
+//
+
+// DROP OLDEST STEP FROM UNDO LOG
+Local void undo_drop(Readline *rs)
 {
-    char c;
-    fread(&c, 1, 1, stdin);     // assume we're invoked in raw mode (stty raw)
-    return c;
+    int n, i;
+    long bytes;
+    for ( n=1; n<rs->ulogn && rs->ulog[n].step == rs->ulog[0].step; n++ ) { }
+    bytes = ( n < rs->ulogn ) ? rs->ulog[n].off : rs->ubytes;
+    memmove(rs->ubuf, rs->ubuf + bytes, (size_t)(rs->ubytes - bytes));
+    memmove(rs->ulog, rs->ulog + n, sizeof(RLUndo) * (rs->ulogn - n));
+    rs->ubytes -= bytes;
+    rs->ulogn  -= n;
+    rs->utop    = MAX(rs->utop - n, 0);
+    for ( i=0; i<rs->ulogn; i++ ) rs->ulog[i].off -= bytes;
 }
-#endif
 
-//UNUSED Local void beep(void)
-//UNUSED {
-//UNUSED    sound(1000);        // TC: speaker frequency (1khz)
-//UNUSED    delay(250); // TC: time in msecs (1/4 sec)
-//UNUSED    nosound();  // TC: stop sound
-//UNUSED }
+// MAKE ROOM IN UNDO LOG FOR 'n' MORE BYTES, AND A DELTA
+// Returns:
+//    1 -- OK
+//    0 -- no memory (log was emptied)
+//
+Local int undo_room(Readline *rs, long n)
+{
+    long size, most = MAX(UNDO_BYTES, 2L * rs->maxline);
+    void *p;
+    while ( rs->ubytes + n > most && rs->ulogn > 0 ) undo_drop(rs);
+    if ( rs->ubytes + n > rs->usize ) {
+        size = MIN(MAX(rs->usize * 2, rs->ubytes + n + 64), most);
+        if ( (p = realloc(rs->ubuf, (size_t)size)) == 0 ) goto nomem;
+        rs->ubuf  = (char*)p;
+        rs->usize = size;
+    }
+    if ( rs->ulogn == rs->ulogsize ) {
+        size = MAX(rs->ulogsize * 2, 16);
+        if ( (p = realloc(rs->ulog, sizeof(RLUndo) * size)) == 0 ) goto nomem;
+        rs->ulog     = (RLUndo*)p;
+        rs->ulogsize = (int)size;
+    }
+    return 1;
+nomem:
+    rs->ulogn = rs->utop = 0;
+    rs->ubytes = 0;
+    return 0;
+}
 
-// POSITION CURSOR (ZERO BASED)
-Local void cursor_pos(int x, int y)
+// LOG EDIT: AT 'pos', 'ndel' CHARS 'del' REMOVED, 'nins' CHARS 'ins' INSERTED
+//    Extends the last delta if it's the same step and this continues it
+//    (typing along, or deleting forward or back).
+//
+Local void undo_add(Readline *rs, int pos, const char *del, int ndel,
+                    const char *ins, int nins)
 {
-    printf("\033[%d;%dH", y+1, x+1);    // 0,0 -> 1,1
+    RLUndo *u;
+    if ( ndel == 0 && nins == 0 ) return;
+    rs->ulogn  = rs->utop;                      // can't redo past an edit
+    rs->ubytes = rs->utop ? rs->ulog[rs->utop-1].off + rs->ulog[rs->utop-1].del
+                                                     + rs->ulog[rs->utop-1].ins : 0;
+    if ( ! undo_room(rs, ndel + nins) ) return;
+    u = rs->utop ? rs->ulog + rs->utop - 1 : 0;
+    if ( u && u->step == rs->ustep && u->ins == 0 && nins == 0 && u->del + ndel > 0 ) {
+        if ( pos == u->pos ) {                  // deleting forward
+            memcpy(rs->ubuf + rs->ubytes, del, ndel);
+            u->del += ndel;
+            rs->ubytes += ndel;
+            return;
+        }
+        if ( pos + ndel == u->pos ) {           // deleting back
+            memmove(rs->ubuf + u->off + ndel, rs->ubuf + u->off, u->del);
+            memcpy(rs->ubuf + u->off, del, ndel);
+            u->pos  = pos;
+            u->del += ndel;
+            rs->ubytes += ndel;
+            return;
+        }
+    }
+    if ( u && u->step == rs->ustep && u->del == 0 && ndel == 0 &&
+         pos == u->pos + u->ins ) {             // typing along
+        memcpy(rs->ubuf + rs->ubytes, ins, nins);
+        u->ins += nins;
+        rs->ubytes += nins;
+        return;
+    }
+    u = rs->ulog + rs->ulogn++;
+    u->pos  = pos;
+    u->del  = ndel;
+    u->ins  = nins;
+    u->cur  = rs->ucur;
+    u->off  = rs->ubytes;
+    u->step = rs->ustep;
+    if ( ndel ) memcpy(rs->ubuf + rs->ubytes, del, ndel);
+    if ( nins ) memcpy(rs->ubuf + rs->ubytes + ndel, ins, nins);
+    rs->ubytes += ndel + nins;
+    rs->utop = rs->ulogn;
 }
 
-// PLOT CHAR 'c' ATTRIBUTE 'attr' AT POSITION x,y (ZERO BASED)
-Local void PlotAttr(int x, int y, uchar c, uchar attr)
+// MAKE LINE EDITABLE
+//    If line is showing a history entry, copy it to the edit buffer.
+//    That replaces what was there, so it's a step of its own in the
+//    undo log.
+//
+Local void line_edit(Readline *rs)
 {
-#ifdef LINUX
-    cursor_pos(x,y); printf("%c",c);
-#else
-    uchar far *mono = MK_FP(0xb000, (y*160)+(x*2));
-    uchar far *cga  = MK_FP(0xb800, (y*160)+(x*2));
-    *mono++ = c; *mono = attr;
-    *cga++  = c; *cga  = attr;
-#endif
+    if ( rs->line == rs->editbuf ) return;
+    rs->ucur = rs->curpos;
+    ++rs->ustep;
+    undo_add(rs, 0, rs->editbuf, rs->editlen, rs->line, rs->linelen);
+    ++rs->ustep;                                // edit that follows is next
+    memmove(rs->editbuf, rs->line, rs->linelen); // gap is at end
+    rs->line    = rs->editbuf;
+    rs->lineseq = -1;
 }
 
-// PLOT CHAR 'c' AT POSITION x,y (ZERO BASED)
-Local void Plot(int x, int y, uchar c)
+// MOVE GAP SO IT STARTS AT LINE POSITION 'pos'
+Local void move_gap(Readline *rs, int pos)
+{
+    char *buf;
+    int n;
+    line_edit(rs);                              // about to change line
+    buf = rs->line;
+    if ( pos < rs->gapstart ) {                 // move text after gap
+        n = rs->gapstart - pos;
+        STAT(rs, moved, n);
+        memmove(buf + rs->gapend - n, buf + pos, n);
+        rs->gapstart -= n;
+        rs->gapend   -= n;
+    } else if ( pos > rs->gapstart ) {          // move text before gap
+        n = pos - rs->gapstart;
+        STAT(rs, moved, n);
+        memmove(buf + rs->gapstart, buf + rs->gapend, n);
+        rs->gapstart += n;
+        rs->gapend   += n;
+    }
+}
+
+// RETURN CHAR AT LINE POSITION 'i'
+Local char line_at(Readline *rs, int i)
 {
-    PlotAttr(x, y, c, 0x07);    // 'normal' attribute
+    if ( i >= rs->gapstart ) i += rs->gapend - rs->gapstart;
+    return rs->line[i];
 }
 
-// CLEAR FROM (x,y) TO END OF SCREEN
-//     ..using character 'c' as the clear character
+// RETURN SPAN 'seg' OF THE LINE (0=before gap, 1=after gap)
+//    Returns span's length, sets *sp to its first char.
 //
-Local void Cleos(Readline *rs, int x, int y, char c)
+Local int line_span(Readline *rs, int seg, const char **sp)
 {
-    // CLEAR TO EOS
-    while ( y <= rs->scrn_h ) {
-        Plot(x, y, c);
-        if ( ++x > rs->scrn_w ) { x = 0; ++y; }
+    if ( seg == 0 ) {
+        *sp = rs->line;
+        return rs->gapstart;
     }
+    if ( rs->gapend == rs->maxline ) {          // nothing after gap
+        *sp = rs->line;
+        return 0;
+    }
+    *sp = rs->line + rs->gapend;
+    return rs->maxline - rs->gapend;
 }
 
-// 80 //////////////////////////////////////////////////////////////////////////
+// RETURN LINE AS A NULL TERMINATED STRING
+//    Closes the gap by moving it to the end of the line.
+//    A history entry being shown already is one.
+//
+Local char* line_str(Readline *rs)
+{
+    if ( rs->line != rs->editbuf ) return rs->line;
+    move_gap(rs, rs->linelen);
+    rs->line[rs->linelen] = 0;
+    return rs->line;
+}
 
-// RETURN LENGTH OF STRING IN SCREEN UNITS TO CALCULATE SCREEN WRAPS
-//
-//    Returns the unclipped length of string from left edge of line
-//    with prompt to end of line. This can be used to accurately
-//    calculate how many screen wraps the line will make when drawn.
-//
-//    Like strlen(), but includes tab expansions.
-//    'xoff' indicates x position of start of string
-//    as this is needed to accurately calculate tab columns.
-//
-Local int screen_len(Readline *rs,	// used for screen dimensions
-		     const char *line)  // line being measured
-{
-    int x = rs->promptx + strlen(rs->prompt);
-    int len = x;
-    while ( *line ) {
-        if ( *line == 0x09 ) {   // tab char?
-            do {
-	        ++len;
-		x = (x+1) % rs->scrn_w;
-                if ( (x % 8) == 0 ) break;   // hit tab column? stop
-            } while (1);
-	} else {
-	    ++len;
-	    ++x;
-	}
-	++line;
-    }
-    return len;
+// MARK LINE CHANGED FROM POSITION 'pos' ON
+//    Tells the layout cache and next frame where to start over.
+//    Cells of the chars up to and including 'pos' are still good
+//    (with UTF-8 chars, not 'pos': a wide char there may need padding).
+//
+Local void line_dirty(Readline *rs, int pos)
+{
+    int keep = ( rs->utf8 && rs->linehigh ) ? 0 : 1;   // cells kept at 'pos'
+    rs->colvalid = MIN(rs->colvalid, pos + keep);
+    rs->dirty    = MIN(rs->dirty, pos);
 }
 
-// DRAW STRING AT (x,y) LEAVING (x,y) ADJUSTED
-Local void Draw(Readline *rs, int *xp, int *yp, const char *s)
+// REPLACE CONTENTS OF LINE WITH STRING 's'
+Local void line_set(Readline *rs, const char *s)
 {
-    int x = *xp, y = *yp;
-    int cnt = 0;
-    for ( ; *s && cnt<rs->maxline; s++,cnt++ ) {
-        // Special case for TAB character
-        //    Draw tab as spaces up to 8th column
-        //
-        if ( *s == 0x09 ) {
-            do {
-                Plot(x, y, ' ');
-                if ( ++x > (rs->scrn_w-1) ) { x = 0; ++y; }
-                if ( (x % 8) == 0 ) break;   // hit tab column? stop
-            } while (1);
-            continue;
-        }
-        Plot(x, y, *s);
-        if ( ++x > (rs->scrn_w-1) ) { x = 0; ++y; }
-    }
-    *xp = x; *yp = y;
+    int len = (int)MIN(strlen(s), (size_t)(rs->maxline-1));
+    rs->line    = rs->editbuf;
+    rs->lineseq = -1;
+    memmove(rs->line, s, len);
+    rs->line[len] = 0;
+    rs->linelen  = len;
+    for ( rs->linehigh=0; *s; s++ )
+        if ( *s & 0x80 ) rs->linehigh = 1;
+    rs->gapstart = len;         // gap at end of line
+    rs->gapend   = rs->maxline;
+    line_dirty(rs, 0);
 }
 
-// FORCE PAGE TO SCROLL UP ONE LINE
-Local void scroll_up(int lines)
+//UNUSED Local void beep(void)
+//UNUSED {
+//UNUSED    sound(1000);        // TC: speaker frequency (1khz)
+//UNUSED    delay(250); // TC: time in msecs (1/4 sec)
+//UNUSED    nosound();  // TC: stop sound
+//UNUSED }
+
+////          ///////////////////////////////////////////
+//// SCANNING ///////////////////////////////////////////
+////          ///////////////////////////////////////////
+
+// Layout, drawing and the word keys mostly look for the next tab,
+// space or non-space in a run of plain chars, which on a long line
+// is a lot of bytes to step through. These look at 32 bytes at a
+// time with AVX2, 16 with SSE2, else a machine word at a time (4
+// bytes on DOS), and only step bytes to find which one it was.
+// Compile with -DREADLINE_NOSIMD to use the word at a time code.
+//
+
+#define ONES  (~0UL / 255)      // 0x0101..01: a byte repeated in a word
+#define HIGHS (ONES * 0x80)     // 0x8080..80: top bit of each byte
+#define SCAN_RUN 16             // tab_run(): bytes stepped before scanning
+
+// 1 IF BYTE 'c' IS (want=1) OR ISN'T (want=0) 'a' OR 'b'
+#define SCAN_HIT(c,a,b,want)   ((((c) == (a)) || ((c) == (b))) == (want))
+
+#ifndef SCAN_SSE2
+// BYTES OF WORD 'x' THAT ARE 'a' OR 'b' (ra, rb: a, b in every byte)
+//    Returns them with their top bit set, others zero.
+//
+Local ulong word_match(ulong x, ulong ra, ulong rb)
 {
-    printf("\33[s"		// save cursor
-           "\33[25;0H");	// go to bottom line
-    while (lines-- > 0 ) printf("\n");
-    printf("\33[u");            // restore cursor to where it was
+    const ulong low = ONES * 0x7f;
+    ulong ya = x ^ ra, yb = x ^ rb;             // zero bytes where they are
+    ya = ~(((ya & low) + low) | ya | low);
+    yb = ~(((yb & low) + low) | yb | low);
+    return ya | yb;
 }
 
-// REDRAW LINE AT PROMPT
-//    Draw directly to the screen to prevent cursor chatter
+// WORD OF BYTES AT 'p'
+//    Copied rather than read through a ulong pointer, which would break
+//    the aliasing rules; the compiler makes it one load.
 //
-Local void redraw_line(Readline *rs)
+Local ulong word_load(const char *p)
 {
-    char *line  = rs->history[0];           // redraw current line
-    int linelen = screen_len(rs, line);     // like strlen but includes tabs
+    ulong w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+#endif
 
-    // IF LINE WOULD RUN OFF EDGE OF LAST LINE OF SCREEN, ADJUST PROMPTY
-    //
-    //   Once adjusted, subsequent calls won't retrigger this code
-    //   because prompty is now /adjusted/, taking into account the
-    //   scrolling that will happen when the line is actually printed.
-    //
-    int new_y = (rs->prompty + (linelen / rs->scrn_w));
-    int max_y = (rs->scrn_h-1);
-    if ( new_y > max_y ) {
-        int diff = new_y - max_y;
-        // Adjust prompty to be higher now that screen scrolled up
-        rs->prompty -= diff;
-	scroll_up(diff);
+// FIRST BYTE OF 's' ('n' BYTES) THAT IS (want=1) OR ISN'T (want=0) 'a' OR 'b'
+//    For one byte value, pass it as both 'a' and 'b'.
+// Returns:
+//    Its index, or 'n' if there's none
+//
+Local int scan_fwd(const char *s, int n, char a, char b, int want)
+{
+    int i = 0;
+#ifdef SCAN_AVX2
+    {
+        __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+        uint m;
+        for ( ; n - i >= 32; i += 32 ) {
+            v = _mm256_loadu_si256((const __m256i*)(s + i));
+            m = (uint)_mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+            if ( ! want ) m = ~m;
+            if ( m ) return i + __builtin_ctz(m);
+        }
     }
-
-    // DRAW ENTIRE LINE (INCLUDING PROMPT) TO EOS
+#endif
+#ifdef SCAN_SSE2
     {
-	int x = rs->promptx;
-	int y = rs->prompty;
-	Draw(rs, &x, &y, rs->prompt);     // DRAW PROMPT
-	Draw(rs, &x, &y, rs->history[0]); // DRAW LINE BEING EDITED
-	Cleos(rs, x, y, ' ');             // CLEAR TO EOS
+        __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+        uint m;
+        for ( ; n - i >= 16; i += 16 ) {
+            v = _mm_loadu_si128((const __m128i*)(s + i));
+            m = (uint)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+            if ( ! want ) m ^= 0xffff;
+            if ( m ) return i + __builtin_ctz(m);
+        }
     }
-
-    // LEAVE CURSOR AT INSERT POINT
+#else
     {
-        int x = rs->promptx + strlen(rs->prompt);
-        int y = rs->prompty;
-        int i = 0;
+        ulong ra = ONES * (uchar)a, rb = ONES * (uchar)b;
+        ulong skip = want ? 0 : HIGHS;          // words with no hit match so
+        for ( ; i < n && ((ulong)(s + i) & (sizeof(ulong)-1)); i++ )
+            if ( SCAN_HIT(s[i], a, b, want) ) return i;     // up to alignment
+        while ( n - i >= (int)sizeof(ulong) &&
+                word_match(word_load(s + i), ra, rb) == skip )
+            i += sizeof(ulong);
+    }
+#endif
+    for ( ; i < n; i++ )
+        if ( SCAN_HIT(s[i], a, b, want) ) return i;
+    return n;
+}
 
-        // Find x,y for curpos
-        //    Take into account tabs
-        //
-        while ( line[i] ) {
-            if ( i == rs->curpos ) break;
-            if ( line[i] == 0x09 ) {
-                do { if ( (++x%8) == 0 ) break; } while(1);
-            } else { ++x; }
-            if ( ++i == rs->maxline ) break;
+// LAST BYTE OF 's' ('n' BYTES) THAT IS (want=1) OR ISN'T (want=0) 'a' OR 'b'
+// Returns:
+//    Its index, or -1 if there's none
+//
+Local int scan_back(const char *s, int n, char a, char b, int want)
+{
+#ifdef SCAN_AVX2
+    {
+        __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+        uint m;
+        for ( ; n >= 32; n -= 32 ) {
+            v = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+            m = (uint)_mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+            if ( ! want ) m = ~m;
+            if ( m ) return n - 1 - __builtin_clz(m);
         }
-        // Keep x/y within screen's w/h dimensions
-        y += x/rs->scrn_w;
-        x %= rs->scrn_w;
-        cursor_pos(x, y);
-        if ( rs->literal ) {
-            Plot(x, y, '^');  // put caret under cursor
-            cursor_pos(x, y);
+    }
+#endif
+#ifdef SCAN_SSE2
+    {
+        __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+        uint m;
+        for ( ; n >= 16; n -= 16 ) {
+            v = _mm_loadu_si128((const __m128i*)(s + n - 16));
+            m = (uint)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+            if ( ! want ) m ^= 0xffff;
+            if ( m ) return n - 16 + 31 - __builtin_clz(m);
         }
     }
+#else
+    {
+        ulong ra = ONES * (uchar)a, rb = ONES * (uchar)b;
+        ulong skip = want ? 0 : HIGHS;
+        for ( ; n > 0 && ((ulong)(s + n) & (sizeof(ulong)-1)); n-- )
+            if ( SCAN_HIT(s[n-1], a, b, want) ) return n - 1;
+        while ( n >= (int)sizeof(ulong) &&
+                word_match(word_load(s + n - sizeof(ulong)), ra, rb) == skip )
+            n -= sizeof(ulong);
+    }
+#endif
+    for ( ; n > 0; n-- )
+        if ( SCAN_HIT(s[n-1], a, b, want) ) return n - 1;
+    return -1;
 }
 
-////              ///////////////////////////////////////
-//// LINE EDITING ///////////////////////////////////////
-////              ///////////////////////////////////////
+// RETURN LENGTH OF RUN OF ASCII BYTES AT START OF 's' ('n' BYTES)
+//    (up to the first byte with its top bit set)
+//
+Local int ascii_len(const char *s, int n)
+{
+    int i = 0;
+#ifdef SCAN_AVX2
+    {
+        uint m;
+        for ( ; n - i >= 32; i += 32 ) {
+            m = (uint)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(s + i)));
+            if ( m ) return i + __builtin_ctz(m);
+        }
+    }
+#endif
+#ifdef SCAN_SSE2
+    {
+        uint m;
+        for ( ; n - i >= 16; i += 16 ) {
+            m = (uint)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+            if ( m ) return i + __builtin_ctz(m);
+        }
+    }
+#else
+    for ( ; i < n && ((ulong)(s + i) & (sizeof(ulong)-1)); i++ )
+        if ( s[i] & 0x80 ) return i;            // up to alignment
+    while ( n - i >= (int)sizeof(ulong) && ! (word_load(s + i) & HIGHS) )
+        i += sizeof(ulong);
+#endif
+    for ( ; i < n; i++ )
+        if ( s[i] & 0x80 ) return i;
+    return n;
+}
 
-// DELETE CHAR AT CURRENT LINE + CURSOR POSITION
-Local void delete_char(Readline *rs)
+// FIRST LINE POSITION 'from' UP TO 'to' THAT IS (want=1) OR ISN'T (want=0)
+// BYTE 'a' OR 'b'
+//    Scans the spans on either side of the gap.
+// Returns:
+//    The position, or 'to' if there's none
+//
+Local int line_find(Readline *rs, int from, int to, char a, char b, int want)
 {
-    int i;
-    int maxline = rs->maxline;
-    int curpos  = MIN(rs->curpos, maxline-2);   // leave room for char + NULL
-    char *line  = rs->history[0];               // entire line being edited
+    int seg, off, n, end;
+    const char *s;
+    for ( seg=0,off=0; seg<2 && from<to; seg++,off+=n ) {
+        n = line_span(rs, seg, &s);
+        if ( from >= off + n ) continue;
+        end   = MIN(to, off + n);
+        from += scan_fwd(s + from - off, end - from, a, b, want);
+        if ( from < end ) return from;
+    }
+    return to;
+}
 
-    if ( line[curpos] == 0 ) return;            // dont delete NULL!
-    for ( i=curpos; i<(maxline-1); i++ )
-        { line[i] = line[i+1]; }
-    line[maxline-1] = 0;        // ensure line terminated
+// LAST LINE POSITION 'from' UP TO 'to' THAT IS (want=1) OR ISN'T (want=0)
+// BYTE 'a' OR 'b'
+// Returns:
+//    The position, or 'from'-1 if there's none
+//
+Local int line_rfind(Readline *rs, int from, int to, char a, char b, int want)
+{
+    int seg, off, lo, i;
+    const char *s;
+    for ( seg=1; seg>=0 && from<to; seg-- ) {
+        line_span(rs, seg, &s);
+        off = seg ? rs->gapstart : 0;
+        if ( to <= off ) continue;
+        lo = MAX(from, off);
+        if ( (i = scan_back(s + lo - off, to - lo, a, b, want)) >= 0 )
+            return lo + i;
+        to = lo;
+    }
+    return from - 1;
 }
 
-// INSERT CHAR 'c' INTO CURRENT LINE + CURSOR POSITION
-//     Where rs->history[0] is current line, rs->curpos is cursor pos'n
+// LENGTH OF RUN OF NON-TAB BYTES AT START OF 's' ('n' BYTES)
+//    Runs are mostly short, so the first SCAN_RUN bytes are just
+//    stepped; a longer one is scanned on to the next tab.
 //
-Local void insert_char(Readline *rs, char c)
+Local int tab_run(const char *s, int n)
 {
     int i;
-    int maxline = rs->maxline;
-    int curpos  = MIN(rs->curpos, maxline-2);   // leave room for char + NULL
-    char *line  = rs->history[0];               // entire line being edited
+    for ( i=0; i<n && i<SCAN_RUN; i++ )
+        if ( s[i] == 0x09 ) return i;
+    return ( i == n ) ? n : i + scan_fwd(s + i, n - i, 0x09, 0x09, 1);
+}
 
-    //DEBUG printf("\33[10;0HMaxLine=%d CurPos=%d mincurpos=%d\n",
-    //DEBUG     maxline, rs->curpos, curpos);
+////       //////////////////////////////////////////////
+//// UTF-8 //////////////////////////////////////////////
+////       //////////////////////////////////////////////
 
-    // INSERT
-    //     Start at eol, drag chars to right until cursor
-    //
-    for ( i=maxline-1; i>curpos; i-- )
-        { line[i] = line[i-1]; }
+// With rs->utf8 set, the line and prompt are UTF-8: a char is a code
+// point, plus any zero width marks that combine with it, and takes
+// the cells its width says (East Asian wide chars take two). The line
+// stays bytes; cols[] gives each char's first byte its cell, and its
+// other bytes the cell after it. Bytes that aren't valid UTF-8 are a
+// char each, shown as '?'.
+//
+// Most lines are all ASCII, so layout and drawing check for that, and
+// do those one byte per cell as always: rs->linehigh says if any
+// non-ASCII byte went into the line at all, and if one did, the part
+// being laid out or drawn is checked with ascii_len().
+//
 
-    line[curpos] = c;           // drop in char
-    line[maxline-1] = 0;        // ensure line terminated
-}
+#define CELL_TAIL   -1L         // shadow: right half of a wide char
+#define CELL_REDRAW -2L         // shadow: char with marks, always plotted
+#define GLYPH_MAX   16          // most bytes of a char drawn (base + marks)
 
-// MOVE CURSOR TO LEFT (IF POSSIBLE)
-//     Won't move into prompt.
+// Code points that aren't one cell wide, sorted, for width_of()
+typedef struct {
+    long lo, hi;        // code points lo thru hi..
+    int width;          // ..take this many cells
+} RLWidth;
+
+static const RLWidth widths[] = {
+    { 0x0300, 0x036f, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05bd, 0 },
+    { 0x05bf, 0x05bf, 0 }, { 0x05c1, 0x05c2, 0 }, { 0x05c4, 0x05c5, 0 },
+    { 0x05c7, 0x05c7, 0 }, { 0x0610, 0x061a, 0 }, { 0x064b, 0x065f, 0 },
+    { 0x0670, 0x0670, 0 }, { 0x06d6, 0x06dc, 0 }, { 0x06df, 0x06e4, 0 },
+    { 0x06e7, 0x06e8, 0 }, { 0x06ea, 0x06ed, 0 }, { 0x0711, 0x0711, 0 },
+    { 0x0730, 0x074a, 0 }, { 0x07a6, 0x07b0, 0 }, { 0x07eb, 0x07f3, 0 },
+    { 0x0816, 0x082d, 0 }, { 0x0859, 0x085b, 0 }, { 0x08d3, 0x0902, 0 },
+    { 0x093a, 0x093a, 0 }, { 0x093c, 0x093c, 0 }, { 0x0941, 0x0948, 0 },
+    { 0x094d, 0x094d, 0 }, { 0x0951, 0x0957, 0 }, { 0x0962, 0x0963, 0 },
+    { 0x0981, 0x0981, 0 }, { 0x09bc, 0x09bc, 0 }, { 0x09c1, 0x09c4, 0 },
+    { 0x09cd, 0x09cd, 0 }, { 0x09e2, 0x09e3, 0 }, { 0x0a01, 0x0a02, 0 },
+    { 0x0a3c, 0x0a3c, 0 }, { 0x0a41, 0x0a51, 0 }, { 0x0a70, 0x0a71, 0 },
+    { 0x0a81, 0x0a82, 0 }, { 0x0abc, 0x0abc, 0 }, { 0x0ac1, 0x0ac8, 0 },
+    { 0x0acd, 0x0acd, 0 }, { 0x0b01, 0x0b01, 0 }, { 0x0b3c, 0x0b3c, 0 },
+    { 0x0b3f, 0x0b3f, 0 }, { 0x0b41, 0x0b44, 0 }, { 0x0b4d, 0x0b4d, 0 },
+    { 0x0b82, 0x0b82, 0 }, { 0x0bc0, 0x0bc0, 0 }, { 0x0bcd, 0x0bcd, 0 },
+    { 0x0c3e, 0x0c40, 0 }, { 0x0c46, 0x0c56, 0 }, { 0x0cbc, 0x0cbc, 0 },
+    { 0x0ccc, 0x0ccd, 0 }, { 0x0d41, 0x0d44, 0 }, { 0x0d4d, 0x0d4d, 0 },
+    { 0x0dca, 0x0dca, 0 }, { 0x0dd2, 0x0dd6, 0 }, { 0x0e31, 0x0e31, 0 },
+    { 0x0e34, 0x0e3a, 0 }, { 0x0e47, 0x0e4e, 0 }, { 0x0eb1, 0x0eb1, 0 },
+    { 0x0eb4, 0x0ebc, 0 }, { 0x0ec8, 0x0ecd, 0 }, { 0x0f18, 0x0f19, 0 },
+    { 0x0f35, 0x0f35, 0 }, { 0x0f37, 0x0f37, 0 }, { 0x0f39, 0x0f39, 0 },
+    { 0x0f71, 0x0f7e, 0 }, { 0x0f80, 0x0f84, 0 }, { 0x0f86, 0x0f87, 0 },
+    { 0x0f8d, 0x0fbc, 0 }, { 0x0fc6, 0x0fc6, 0 }, { 0x102d, 0x1030, 0 },
+    { 0x1032, 0x1037, 0 }, { 0x1039, 0x103a, 0 }, { 0x1058, 0x1059, 0 },
+    { 0x1100, 0x115f, 2 }, { 0x1160, 0x11ff, 0 }, { 0x135d, 0x135f, 0 },
+    { 0x1712, 0x1714, 0 }, { 0x1732, 0x1734, 0 }, { 0x1752, 0x1753, 0 },
+    { 0x17b4, 0x17b5, 0 }, { 0x17b7, 0x17bd, 0 }, { 0x17c6, 0x17c6, 0 },
+    { 0x17c9, 0x17d3, 0 }, { 0x17dd, 0x17dd, 0 }, { 0x180b, 0x180e, 0 },
+    { 0x18a9, 0x18a9, 0 }, { 0x1920, 0x1922, 0 }, { 0x1927, 0x1928, 0 },
+    { 0x1932, 0x1932, 0 }, { 0x1939, 0x193b, 0 }, { 0x1a17, 0x1a18, 0 },
+    { 0x1ab0, 0x1aff, 0 }, { 0x1b00, 0x1b03, 0 }, { 0x1b34, 0x1b34, 0 },
+    { 0x1b36, 0x1b3a, 0 }, { 0x1b3c, 0x1b3c, 0 }, { 0x1b42, 0x1b42, 0 },
+    { 0x1b6b, 0x1b73, 0 }, { 0x1dc0, 0x1dff, 0 }, { 0x200b, 0x200f, 0 },
+    { 0x202a, 0x202e, 0 }, { 0x2060, 0x2064, 0 }, { 0x20d0, 0x20f0, 0 },
+    { 0x231a, 0x231b, 2 }, { 0x2329, 0x232a, 2 }, { 0x23e9, 0x23ec, 2 },
+    { 0x23f0, 0x23f0, 2 }, { 0x23f3, 0x23f3, 2 }, { 0x25fd, 0x25fe, 2 },
+    { 0x2614, 0x2615, 2 }, { 0x2648, 0x2653, 2 }, { 0x267f, 0x267f, 2 },
+    { 0x2693, 0x2693, 2 }, { 0x26a1, 0x26a1, 2 }, { 0x26aa, 0x26ab, 2 },
+    { 0x26bd, 0x26be, 2 }, { 0x26c4, 0x26c5, 2 }, { 0x26ce, 0x26ce, 2 },
+    { 0x26d4, 0x26d4, 2 }, { 0x26ea, 0x26ea, 2 }, { 0x26f2, 0x26f3, 2 },
+    { 0x26f5, 0x26f5, 2 }, { 0x26fa, 0x26fa, 2 }, { 0x26fd, 0x26fd, 2 },
+    { 0x2705, 0x2705, 2 }, { 0x270a, 0x270b, 2 }, { 0x2728, 0x2728, 2 },
+    { 0x274c, 0x274c, 2 }, { 0x274e, 0x274e, 2 }, { 0x2753, 0x2755, 2 },
+    { 0x2757, 0x2757, 2 }, { 0x2795, 0x2797, 2 }, { 0x27b0, 0x27b0, 2 },
+    { 0x27bf, 0x27bf, 2 }, { 0x2b1b, 0x2b1c, 2 }, { 0x2b50, 0x2b50, 2 },
+    { 0x2b55, 0x2b55, 2 }, { 0x2cef, 0x2cf1, 0 }, { 0x2d7f, 0x2d7f, 0 },
+    { 0x2de0, 0x2dff, 0 }, { 0x2e80, 0x3029, 2 }, { 0x302a, 0x302d, 0 },
+    { 0x302e, 0x303e, 2 }, { 0x3041, 0x3098, 2 }, { 0x3099, 0x309a, 0 },
+    { 0x309b, 0x33ff, 2 }, { 0x3400, 0x4dbf, 2 }, { 0x4e00, 0x9fff, 2 },
+    { 0xa000, 0xa4cf, 2 }, { 0xa66f, 0xa672, 0 }, { 0xa674, 0xa67d, 0 },
+    { 0xa69e, 0xa69f, 0 }, { 0xa6f0, 0xa6f1, 0 }, { 0xa802, 0xa802, 0 },
+    { 0xa806, 0xa806, 0 }, { 0xa80b, 0xa80b, 0 }, { 0xa825, 0xa826, 0 },
+    { 0xa8c4, 0xa8c5, 0 }, { 0xa8e0, 0xa8f1, 0 }, { 0xa926, 0xa92d, 0 },
+    { 0xa947, 0xa951, 0 }, { 0xa960, 0xa97f, 2 }, { 0xa980, 0xa982, 0 },
+    { 0xa9b3, 0xa9b3, 0 }, { 0xa9b6, 0xa9b9, 0 }, { 0xa9bc, 0xa9bd, 0 },
+    { 0xac00, 0xd7a3, 2 }, { 0xd7b0, 0xd7ff, 0 }, { 0xf900, 0xfaff, 2 },
+    { 0xfb1e, 0xfb1e, 0 }, { 0xfe00, 0xfe0f, 0 }, { 0xfe10, 0xfe19, 2 },
+    { 0xfe20, 0xfe2f, 0 }, { 0xfe30, 0xfe6f, 2 }, { 0xfeff, 0xfeff, 0 },
+    { 0xff00, 0xff60, 2 }, { 0xffe0, 0xffe6, 2 }, { 0x101fd, 0x101fd, 0 },
+    { 0x10a01, 0x10a0f, 0 }, { 0x10a38, 0x10a3f, 0 }, { 0x11001, 0x11001, 0 },
+    { 0x11038, 0x11046, 0 }, { 0x1107f, 0x11081, 0 }, { 0x110b3, 0x110b6, 0 },
+    { 0x110b9, 0x110ba, 0 }, { 0x16fe0, 0x16fe4, 2 }, { 0x17000, 0x18aff, 2 },
+    { 0x1b000, 0x1b2ff, 2 }, { 0x1d167, 0x1d169, 0 }, { 0x1d173, 0x1d182, 0 },
+    { 0x1d185, 0x1d18b, 0 }, { 0x1d1aa, 0x1d1ad, 0 }, { 0x1d242, 0x1d244, 0 },
+    { 0x1f004, 0x1f004, 2 }, { 0x1f0cf, 0x1f0cf, 2 }, { 0x1f18e, 0x1f18e, 2 },
+    { 0x1f191, 0x1f19a, 2 }, { 0x1f200, 0x1f202, 2 }, { 0x1f210, 0x1f23b, 2 },
+    { 0x1f240, 0x1f248, 2 }, { 0x1f250, 0x1f251, 2 }, { 0x1f260, 0x1f265, 2 },
+    { 0x1f300, 0x1f320, 2 }, { 0x1f32d, 0x1f335, 2 }, { 0x1f337, 0x1f37c, 2 },
+    { 0x1f37e, 0x1f393, 2 }, { 0x1f3a0, 0x1f3ca, 2 }, { 0x1f3cf, 0x1f3d3, 2 },
+    { 0x1f3e0, 0x1f3f0, 2 }, { 0x1f3f4, 0x1f3f4, 2 }, { 0x1f3f8, 0x1f43e, 2 },
+    { 0x1f440, 0x1f440, 2 }, { 0x1f442, 0x1f4fc, 2 }, { 0x1f4ff, 0x1f53d, 2 },
+    { 0x1f54b, 0x1f54e, 2 }, { 0x1f550, 0x1f567, 2 }, { 0x1f57a, 0x1f57a, 2 },
+    { 0x1f595, 0x1f596, 2 }, { 0x1f5a4, 0x1f5a4, 2 }, { 0x1f5fb, 0x1f64f, 2 },
+    { 0x1f680, 0x1f6c5, 2 }, { 0x1f6cc, 0x1f6cc, 2 }, { 0x1f6d0, 0x1f6d2, 2 },
+    { 0x1f6d5, 0x1f6d7, 2 }, { 0x1f6eb, 0x1f6ec, 2 }, { 0x1f6f4, 0x1f6fc, 2 },
+    { 0x1f7e0, 0x1f7eb, 2 }, { 0x1f90c, 0x1f93a, 2 }, { 0x1f93c, 0x1f945, 2 },
+    { 0x1f947, 0x1f9ff, 2 }, { 0x1fa70, 0x1faff, 2 }, { 0x20000, 0x2fffd, 2 },
+    { 0x30000, 0x3fffd, 2 }, { 0xe0001, 0xe0001, 0 }, { 0xe0020, 0xe007f, 0 },
+    { 0xe0100, 0xe01ef, 0 },
+};
+
+// CELLS CODE POINT 'cp' TAKES ON SCREEN (0, 1 OR 2)
+//    Binary search of widths[]; nothing below U+0300 needs it.
 //
-Local void cursor_left(Readline *rs)
+Local int width_of(long cp)
 {
-    if ( rs->curpos > 0 ) --rs->curpos;
+    int lo = 0, hi = sizeof(widths) / sizeof(widths[0]) - 1, mid;
+    if ( cp < 0x300 ) return 1;
+    while ( lo <= hi ) {
+        mid = (lo + hi) / 2;
+        if      ( cp < widths[mid].lo ) hi = mid - 1;
+        else if ( cp > widths[mid].hi ) lo = mid + 1;
+        else return widths[mid].width;
+    }
+    return 1;
 }
 
-// MOVE CURSOR TO RIGHT (IF POSSIBLE)
-//     Won't advance beyond end of string or maxline
+// DECODE UTF-8 CHAR AT 's' ('n' BYTES THERE) INTO *cp
+// Returns:
+//    Bytes it takes (1 if not valid UTF-8, *cp set to -1)
 //
-Local void cursor_right(Readline *rs)
+Local int utf8_decode(const char *s, int n, long *cp)
 {
-    int max = MIN(strlen(rs->history[0]), (rs->maxline-1));
-    if ( rs->curpos < max ) ++rs->curpos;
+    uchar c = (uchar)s[0];
+    int len, i;
+    long v, min;
+    if      ( c < 0x80 ) { *cp = c; return 1; }
+    else if ( c < 0xc2 ) { *cp = -1; return 1; }   // stray tail or overlong
+    else if ( c < 0xe0 ) { len = 2; v = c & 0x1f; min = 0x80;    }
+    else if ( c < 0xf0 ) { len = 3; v = c & 0x0f; min = 0x800;   }
+    else if ( c < 0xf5 ) { len = 4; v = c & 0x07; min = 0x10000; }
+    else                 { *cp = -1; return 1; }
+    if ( n < len ) { *cp = -1; return 1; }
+    for ( i=1; i<len; i++ ) {
+        if ( ((uchar)s[i] & 0xc0) != 0x80 ) { *cp = -1; return 1; }
+        v = (v << 6) | ((uchar)s[i] & 0x3f);
+    }
+    if ( v < min || v > 0x10ffffL || (v >= 0xd800 && v <= 0xdfff) )
+        { *cp = -1; return 1; }
+    *cp = v;
+    return len;
 }
 
-Local void cursor_sol(Readline *rs)
+// RETURN 1 IF LINE POSITIONS 'from' UP TO 'to' ARE ALL ONE BYTE A CELL
+//    (or rs->utf8 is off, so all chars are)
+//
+Local int line_ascii(Readline *rs, int from, int to)
 {
-    rs->curpos = 0;
+    int n;
+    if ( ! rs->utf8 || ! rs->linehigh ) return 1;   // (the usual)
+    if ( from < rs->gapstart ) {                // before the gap
+        n = MIN(to, rs->gapstart) - from;
+        if ( n > 0 && ascii_len(rs->line + from, n) < n ) return 0;
+        from += n;
+    }
+    n = to - from;                              // after it
+    return ( n <= 0 ||
+             ascii_len(rs->line + from + rs->gapend - rs->gapstart, n) == n );
 }
 
-Local void cursor_eol(Readline *rs)
+// NEXT CHAR OF STRING 's' ('n' BYTES): CODE POINT AND CELLS INTO *cp, *w
+//    Not counting marks after it. Not valid UTF-8? *cp is -1, one cell.
+// Returns:
+//    Bytes it takes
+//
+Local int str_char(Readline *rs, const char *s, int n, long *cp, int *w)
 {
-    int eol = MIN(strlen(rs->history[0]), (rs->maxline-1));
-    rs->curpos = eol;
+    int len;
+    if ( (uchar)*s < 0x80 || ! rs->utf8 ) { *cp = (uchar)*s; *w = 1; return 1; }
+    len = utf8_decode(s, n, cp);
+    *w  = ( *cp < 0 ) ? 1 : width_of(*cp);
+    return len;
 }
 
-// MOVE TO FIRST LETTER IN EACH WORD
-//     Look for a letter preceded by whitespace.
+// NEXT GLYPH OF STRING 's' ('n' BYTES): A CHAR AND THE MARKS AFTER IT
+//    *id is what the shadow keeps for its cell: the code point, -1 if
+//    not valid UTF-8, CELL_REDRAW if there are marks.
+// Returns:
+//    Bytes it takes
 //
-Local void word_right(Readline *rs)
+Local int str_glyph(Readline *rs, const char *s, int n, long *id, int *w)
 {
-    char *line = rs->history[0];
-    int    end = strlen(line);
-    cursor_right(rs);
-    while ( rs->curpos < end ) {
-        char lc = line[rs->curpos];
-        cursor_right(rs);
-        if ( lc == ' ' && line[rs->curpos] != ' ' )
-            { break; }
+    int len = str_char(rs, s, n, id, w), m, mw;
+    long cp;
+    if ( ! rs->utf8 ) return len;
+    while ( len < n && (uchar)s[len] >= 0x80 ) {
+        m = str_char(rs, s + len, n - len, &cp, &mw);
+        if ( cp < 0 || mw != 0 ) break;         // not a mark
+        len += m;
+        if ( *id >= 0 ) *id = CELL_REDRAW;
     }
+    return len;
 }
 
-// MOVE TO FIRST LETTER IN EACH WORD
-//     Look for a letter preceded by whitespace.
-//
-Local void word_left(Readline *rs, int del)
+// CELLS STRING 's' ('n' BYTES, NO TABS) TAKES
+Local int str_cells(Readline *rs, const char *s, int n)
 {
-    int lcp = rs->curpos;
-    char *line = rs->history[0];
-
-    // Move left at *least* once
-    cursor_left(rs);
-
-    // Delete? If not first char, delete char
-    if ( del && lcp != 0 ) delete_char(rs);
-
-    // Word loop..
-    while ( rs->curpos > 0 ) {
-        char lc = line[rs->curpos];     // save last char
-        int  lcp = rs->curpos;          // save last curpos
-        cursor_left(rs);                // move left
-        if ( line[rs->curpos] == ' ' && lc != ' ' ) // start of word?
-            { cursor_right(rs); break; }            // move fwd, done
-        if ( del && lcp != 0 )          // delete? if not first char..
-            delete_char(rs);            // ..then delete char under cursor
+    int  len, w, cells = 0;
+    long id;
+    for ( ; n>0; s+=len,n-=len ) {
+        len = str_glyph(rs, s, n, &id, &w);
+        cells += w;
     }
+    return cells;
 }
 
-Local void backspace(Readline *rs)
+// BYTES OF STRING 's' ('n' BYTES) THAT FIT IN 'cells' CELLS (NO TABS)
+Local int str_fit(Readline *rs, const char *s, int n, int cells)
 {
-    if ( rs->curpos > 0 )
-        { cursor_left(rs); delete_char(rs); }
+    int  len, w, used = 0;
+    long id;
+    for ( len=0; len<n; len+=used ) {
+        used = str_glyph(rs, s + len, n - len, &id, &w);
+        if ( (cells -= w) < 0 ) break;
+    }
+    return len;
 }
 
-// APPEND A CHARACTER TO LINE AT CURRENT CURSOR POSITION
-//    Insert character at cursor position, then move right
+// COPY UP TO 'max' BYTES OF LINE FROM POSITION 'pos' TO 'buf'
+// Returns:
+//    Bytes copied
 //
-Local void append_char(Readline *rs, char c)
+Local int line_get(Readline *rs, int pos, char *buf, int max)
 {
-    insert_char(rs, c);
-    cursor_right(rs);
+    int n;
+    max = MIN(max, rs->linelen - pos);
+    for ( n=0; n<max; n++ ) buf[n] = line_at(rs, pos + n);
+    return n;
 }
 
-// CLEAR ALL CHARACTERS TO EOL
-Local void clear_eol(Readline *rs)
+// LINE CHAR AT POSITION 'pos': CODE POINT AND CELLS INTO *cp, *w
+// Returns:
+//    Bytes it takes
+//
+Local int line_char(Readline *rs, int pos, long *cp, int *w)
 {
-    char *line = rs->history[0];
-    line[rs->curpos] = 0;       // truncate at cursor pos
-    cursor_eol(rs);             // move to eol
+    char buf[4];
+    int  n;
+    if ( (uchar)line_at(rs, pos) < 0x80 || ! rs->utf8 ) {
+        *cp = (uchar)line_at(rs, pos);
+        *w  = 1;
+        return 1;
+    }
+    n = line_get(rs, pos, buf, 4);
+    return str_char(rs, buf, n, cp, w);
 }
 
-// SAVE CURRENT LINE TO UNDO BUFFER
-Local void undo_save(Readline *rs)
+// RETURN 1 IF LINE POSITION 'pos' STARTS A ZERO WIDTH MARK
+Local int line_mark(Readline *rs, int pos)
 {
-    rs->undocurpos = rs->curpos;                // remember cursor pos (^K)
-    strcpy(rs->undoline, rs->history[0]);       // remember line
+    long cp;
+    int  w;
+    if ( (uchar)line_at(rs, pos) < 0x80 ) return 0;
+    line_char(rs, pos, &cp, &w);
+    return ( cp >= 0 && w == 0 );
 }
 
-// RESTORE CURRENT LINE FROM COPY IN UNDO BUFFER
-Local void undo_restore(Readline *rs)
+// RETURN 1 IF LINE POSITION 'pos' IS A UTF-8 TAIL BYTE
+Local int line_tail(Readline *rs, int pos)
 {
-    strcpy(rs->history[0], rs->undoline);       // restore line
-    rs->curpos = MIN(rs->undocurpos, strlen(rs->history[0]));
+    return ( (uchar)line_at(rs, pos) & 0xc0 ) == 0x80;
 }
 
-////                 ////////////////////////////////////
-//// COMMAND HISTORY ////////////////////////////////////
-////                 ////////////////////////////////////
+// RETURN POSITION AFTER THE LINE CHAR (AND ITS MARKS) AT 'pos'
+Local int char_next(Readline *rs, int pos)
+{
+    long cp;
+    int  w;
+    if ( pos >= rs->linelen ) return pos;
+    if ( ! rs->utf8 ) return pos + 1;
+    pos += line_char(rs, pos, &cp, &w);
+    while ( pos < rs->linelen && line_mark(rs, pos) ) pos += line_char(rs, pos, &cp, &w);
+    return pos;
+}
 
-// MOVE UP TO REVEAL NEXT HISTORY LINE
-//    If we're on first edit line, SAVE IT FIRST,
-//    then copy down from history over it
-// Returns:
-//    1 -- Successfully moved up one line
-//    0 -- Can't go higher
+// RETURN START OF THE LINE CHAR 'pos' IS IN (BACK OVER TAIL BYTES, MARKS)
+//    Can land before where a bad byte sequence started, never after.
 //
-Local int history_up(Readline *rs)
+Local int char_start(Readline *rs, int pos)
 {
-    // Already at top? Do nothing
-    if ( rs->histpos == (rs->histsize-1) ) { return 0; }
-
-    // Next line up empty? Do nothing
-    if ( rs->history[rs->histpos+1][0] == 0 ) { return 0; }
+    if ( ! rs->utf8 ) return pos;
+    pos = MIN(pos, rs->linelen);
+    for (;;) {
+        while ( pos > 0 && pos < rs->linelen && line_tail(rs, pos) ) --pos;
+        if ( pos > 0 && pos < rs->linelen && line_mark(rs, pos) ) { --pos; continue; }
+        return pos;
+    }
+}
 
-    // Save current edit line to restore for later
-    if ( rs->histpos == 0 )
-        strcpy(rs->histsave, rs->history[0]);
+// RETURN START OF THE LINE CHAR BEFORE POSITION 'pos'
+Local int char_prev(Readline *rs, int pos)
+{
+    int p, q;
+    if ( pos <= 0 ) return 0;
+    if ( ! rs->utf8 ) return pos - 1;
+    p = char_start(rs, pos - 1);
+    // Bad bytes can make that land short of a char ending at 'pos':
+    // step forward to the last char starting before it
+    while ( (q = char_next(rs, p)) < pos ) p = q;
+    return p;
+}
 
-    // Visit next line in history
-    if ( rs->histpos < (rs->histsize-1) )
-        ++rs->histpos;
+////                   //////////////////////////////////
+//// TERMINAL BACKENDS //////////////////////////////////
+////                   //////////////////////////////////
 
-    // Copy that line to current edit line
-    strcpy(rs->history[0], rs->history[rs->histpos]);
+// Everything readline does to the screen and keyboard goes through
+// rs->term, a table of functions for the kind of terminal it is:
+//
+//     ANSI   -- escape sequences to a tty (rs->outfd), keys from rs->infd
+//     DOS    -- chars straight into video ram, cursor by BIOS
+//     memory -- a char array (RLMemTerm), for tests and benchmarks
+//
+// The app can point rs->term (and rs->termdata) at another, e.g. to
+// run a line editor on a socket.
+//
 
-    // Leave cursor at eol
-    rs->curpos = strlen(rs->history[0]);
+#ifdef LINUX
+// Raw mode: one terminal at a time, so it's kept here, where signal
+// handlers and atexit() can get at it to put the terminal back.
+//
+static Readline *raw_rs = 0;            // Readline whose tty is raw (0=none)
+static int raw_fd = -1;                 // its tty
+static int raw_outfd = -1;              // its output, for bracketed paste off
+static struct termios raw_saved;        // tty's mode before going raw
+static int raw_sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, 0 };
+static struct sigaction raw_oldsig[4];  // app's handlers for raw_sigs[]
+static int raw_atexit = 0;              // FLAG: 1=raw_abort() set to run at exit
+static struct sigaction raw_oldwinch;   // app's SIGWINCH handler
+static volatile sig_atomic_t raw_winch = 0;     // FLAG: 1=tty was resized
 
-    return 1;
+// PUT TERMINAL BACK THE WAY WE FOUND IT
+Local void raw_restore(void)
+{
+    int i;
+    if ( raw_fd < 0 ) return;
+    tcsetattr(raw_fd, TCSADRAIN, &raw_saved);
+    for ( i=0; raw_sigs[i]; i++ ) sigaction(raw_sigs[i], &raw_oldsig[i], 0);
+    sigaction(SIGWINCH, &raw_oldwinch, 0);
+    raw_fd = -1;
+    raw_rs = 0;
 }
 
-// MOVE DOWN TO REVEAL PREVIOUS HISTORY LINE
-//    If we're back to first edit line, RESTORE IT
-//    (if not already); user may have visited history and returned.
+// SIGNAL OR EXIT WHILE RAW: RESTORE TERMINAL
+//    Maybe mid-line, so bracketed paste goes off too.
 //
-Local void history_down(Readline *rs)
+Local void raw_abort(void)
 {
-    // Already at bottom? Do nothing
-    if ( rs->histpos == 0 ) return;
-
-    // Move down
-    --rs->histpos;
-
-    // Returned to edit line?
-    if ( rs->histpos == 0 ) {
-        // Restore previous edit line
-        strcpy(rs->history[0], rs->histsave);
-    } else {
-        // Revisit history line selected
-        strcpy(rs->history[0], rs->history[rs->histpos]);
-    }
-
-    // Leave cursor at eol
-    rs->curpos = strlen(rs->history[0]);
+    if ( raw_fd < 0 ) return;
+    if ( write(raw_outfd, "\33[?2004l", 8) < 0 ) { }
+    raw_restore();
 }
 
-// MOVE TO TOP OF HISTORY
-Local void history_top(Readline *rs)
+// SIGNAL WHILE RAW: RESTORE TERMINAL, PASS SIGNAL ON
+Local void raw_signal(int sig)
 {
-    // Already at max top? Do nothing
-    if ( rs->histpos == (rs->histsize-1) ) return;
-
-    // Loop until we reach top
-    //    Need a loop, because 'top' might be NULL.
-    //
-    while ( history_up(rs) )
-        { }
+    raw_abort();                // puts app's handler back..
+    raise(sig);                 // ..which gets the signal once we return
 }
 
-// MOVE TO BOTTOM OF HISTORY (RETURN TO EDIT LINE)
+// SIGWINCH WHILE RAW: FLAG IT FOR ansi_read()
+Local void raw_resized(int sig)
+{
+    sig = sig;                  // unused
+    raw_winch = 1;
+}
+#endif
+
+// PUT TERMINAL IN RAW MODE (on=1), OR BACK TO HOW IT WAS (on=0)
+//    Like 'stty raw -echo', without running stty. readline() does this
+//    itself around each line; with rs->keepraw set, it stays raw between
+//    lines until the app calls readline_rawmode(rs, 0) or FreeReadline().
+//    Terminal is also put back on exit(), SIGHUP, SIGINT, SIGQUIT, SIGTERM.
+//    While raw, SIGWINCH has readline check the terminal's size (and
+//    each line checks it as it begins).
+// Returns:
+//    0 if OK, -1 if rs->infd isn't a terminal (left as is)
+//
+Public int readline_rawmode(Readline *rs, int on)
+{
+#ifdef LINUX
+    struct termios raw;
+    struct sigaction sa;
+    int i;
+    if ( ! on ) {
+        if ( raw_rs == rs ) raw_restore();
+        return 0;
+    }
+    if ( raw_rs == rs ) return 0;               // already raw
+    raw_restore();                              // another Readline's tty?
+    if ( tcgetattr(rs->infd, &raw_saved) < 0 ) return -1;
+    raw = raw_saved;
+    raw.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL|IXON);
+    raw.c_oflag &= ~OPOST;
+    raw.c_lflag &= ~(ECHO|ECHONL|ICANON|ISIG|IEXTEN);
+    raw.c_cflag &= ~(CSIZE|PARENB);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    if ( tcsetattr(rs->infd, TCSADRAIN, &raw) < 0 ) return -1;
+    raw_rs    = rs;
+    raw_fd    = rs->infd;
+    raw_outfd = rs->outfd;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = raw_signal;
+    sigemptyset(&sa.sa_mask);
+    for ( i=0; raw_sigs[i]; i++ ) sigaction(raw_sigs[i], &sa, &raw_oldsig[i]);
+    sa.sa_handler = raw_resized;        // (no SA_RESTART: read() wakes up)
+    sigaction(SIGWINCH, &sa, &raw_oldwinch);
+    if ( ! raw_atexit ) { atexit(raw_abort); raw_atexit = 1; }
+#else
+    rs = rs; on = on;           // getch() is always raw
+#endif
+    return 0;
+}
+
+#ifdef LINUX
+// READ WHATEVER KEYS ARE WAITING INTO 'buf' (AT LEAST ONE)
+//    A paste or typeahead comes in as one read, so it's handled
+//    with one redraw rather than one per char.
+//    If 'timeout' isn't -1, gives up after that many msecs.
+//    Also gives up if the terminal's resized, so the line gets redrawn.
+// Returns:
+//    Number of bytes read (0 if timed out), RL_READ_WOKEN if resized,
+//    or RL_READ_EOF at EOF or error
+//
+Local int ansi_read(Readline *rs, char *buf, int size, int timeout)
+{
+    int n;
+    struct pollfd pfd;
+    pfd.fd     = rs->infd;
+    pfd.events = POLLIN;
+    while ( 1 ) {
+        if ( raw_winch ) {                      // SIGWINCH came in?
+            raw_winch = 0;
+            rs->checksize = 1;
+            return RL_READ_WOKEN;
+        }
+        if ( timeout >= 0 && (n = poll(&pfd, 1, timeout)) <= 0 ) {
+            if ( n == 0 ) return 0;
+            if ( errno == EINTR ) continue;
+        }
+        // Raw mode (see readline_rawmode()), so keys come as typed
+        if ( (n = read(rs->infd, buf, size)) < 0 && errno == EINTR ) continue;
+        break;
+    }
+    return n > 0 ? n : RL_READ_EOF;             // (0 is EOF)
+}
+#else
+// READ WHATEVER KEYS ARE WAITING INTO 'buf' (AT LEAST ONE)
+//    DOS keys come whole, so there's never a need to wait.
+//
+Local int ansi_read(Readline *rs, char *buf, int size, int timeout)
+{
+    int n = 0;
+    rs = rs; timeout = timeout;         // unused
+    buf[n++] = getch();
+    while ( n < size && kbhit() ) buf[n++] = getch();
+    return n;
+}
+#endif
+
+// FLUSH OUTPUT BUFFER TO THE TERMINAL
+//    The whole frame goes out with a single write().
+//
+Local void out_flush(Readline *rs)
+{
+    char *s = rs->outbuf;
+    int   n = rs->outlen;
+    fflush(stdout);             // anything app printf()ed goes out first
+#ifdef LINUX
+    while ( n > 0 ) {
+        int w = write(rs->outfd, s, n);
+        if ( w < 0 ) {
+            if ( errno == EINTR ) continue;
+            break;              // terminal gone? drop frame
+        }
+        s += w; n -= w;
+    }
+#else
+    fwrite(s, 1, n, stdout);
+    fflush(stdout);
+#endif
+    rs->outlen = 0;
+}
+
+// APPEND 'n' BYTES TO OUTPUT BUFFER
+//    Flushes early only if the frame is bigger than the buffer.
+//
+Local void out_write(Readline *rs, const char *s, int n)
+{
+    rs->framebytes += n;
+    STAT(rs, bytes, n);
+    while ( n > 0 ) {
+        int len = MIN(n, rs->outsize - rs->outlen);
+        if ( len == 0 ) { out_flush(rs); continue; }    // buffer full
+        memcpy(rs->outbuf + rs->outlen, s, len);
+        rs->outlen += len;
+        s += len; n -= len;
+    }
+}
+
+// POSITION CURSOR (ZERO BASED)
+//    No output if terminal's cursor is already there.
+//
+Local void cursor_pos(Readline *rs, int x, int y)
+{
+    char esc[32];
+    if ( x == rs->outx && y == rs->outy ) return;
+    sprintf(esc, "\033[%d;%dH", y+1, x+1);      // 0,0 -> 1,1
+    out_write(rs, esc, strlen(esc));
+    rs->outx = x;
+    rs->outy = y;
+}
+
+// ANSI: PUT 'n' CHARS 's' AT x,y
+Local void ansi_put(Readline *rs, int x, int y, const char *s, int n)
+{
+    int i, ctl = 0, high = 0;
+    cursor_pos(rs, x, y);
+    out_write(rs, s, n);
+    // Terminal advances the cursor, but defers wrapping at the right edge.
+    // Raw control chars (^V literals) leave the cursor anywhere.
+    for ( i=0; i<n; i++ ) {
+        if ( (uchar)s[i] < ' ' || s[i] == 0x7f ) ctl = 1;
+        high |= s[i] & 0x80;
+    }
+    rs->outx += high ? str_cells(rs, s, n) : n;     // (UTF-8: by cells)
+    if ( ctl || rs->outx >= rs->scrn_w ) rs->outx = -1;
+}
+
+// ANSI: CLEAR x,y THRU ex,ey
+//    ESC[K clears rest of the row, ESC[J rest of the screen.
+//
+Local void ansi_clear(Readline *rs, int x, int y, int ex, int ey)
+{
+    ex = ex;                            // (clears to the edge anyway)
+    cursor_pos(rs, x, y);
+    out_write(rs, (ey == y) ? "\033[K" : "\033[J", 3);
+}
+
+// ANSI: SCROLL SCREEN UP 'lines' LINES
+Local void ansi_scroll(Readline *rs, int lines)
+{
+    char esc[32];
+    sprintf(esc, "\33[s"               // save cursor
+                 "\33[%d;1H", rs->scrn_h);     // go to bottom line
+    out_write(rs, esc, strlen(esc));
+    while (lines-- > 0 ) out_write(rs, "\n", 1);
+    out_write(rs, "\33[u", 3);         // restore cursor to where it was
+}
+
+// ANSI: START OF A LINE
+//    SIGWINCH is only caught while raw, so a resize between lines is
+//    found by asking the tty driver (cheap) at the start of each line.
+//
+Local void ansi_begin(Readline *rs)
+{
+#ifdef LINUX
+    struct winsize ws;
+#endif
+    rs->outx = -1;                     // app may have moved terminal's cursor
+    rs->outy = -1;
+#ifdef LINUX
+    if ( rs->termsize && ioctl(rs->outfd, TIOCGWINSZ, &ws) == 0 &&
+         ws.ws_col && ws.ws_row &&
+         ( ws.ws_col != rs->scrn_w || ws.ws_row != rs->scrn_h ) )
+        rs->checksize = 1;             // resized since last line
+    readline_rawmode(rs, 1);           // no-op if already raw (keepraw)
+    out_write(rs, "\33[?2004h", 8);    // bracketed paste on
+#endif
+}
+
+// ANSI: LINE DONE
+Local void ansi_end(Readline *rs)
+{
+#ifdef LINUX
+    out_write(rs, "\33[?2004l", 8);    // bracketed paste off
+    if ( ! rs->keepraw ) {
+        rs->term->flush(rs);           // rest of line goes out while raw
+        readline_rawmode(rs, 0);
+    }
+#endif
+    rs->outx = -1;                     // app may print before next line
+    rs->outy = -1;
+}
+
+// ANSI: GET SCREEN SIZE
+//    Asks the tty driver. Failing that (e.g. a serial line), puts the
+//    cursor as far down and right as it goes, and has the terminal
+//    report where that is. Keys typed meanwhile are kept as typeahead.
+//    Not if input or output isn't a tty: nothing would answer.
+// Returns:
+//    1 if *w,*h set, 0 if size unknown
+//
+Local int ansi_size(Readline *rs, int *w, int *h)
+{
+#ifdef LINUX
+    struct winsize ws;
+    char buf[32], *esc;
+    int n = 0, row, col;
+    if ( ioctl(rs->outfd, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row ) {
+        *w = ws.ws_col;
+        *h = ws.ws_row;
+        return 1;
+    }
+    if ( ! isatty(rs->infd) || ! isatty(rs->outfd) ) return 0;
+    out_write(rs, "\33[s\33[999;999H\33[6n\33[u", 20);
+    rs->term->flush(rs);
+    rs->outx = -1;                              // (restored, but be safe)
+    rs->outy = -1;
+    while ( n < (int)sizeof(buf)-1 && ansi_read(rs, buf+n, 1, 100) == 1 )
+        if ( buf[n++] == 'R' ) break;           // ESC[row;colR
+    buf[n] = 0;
+    for ( esc = buf + n; esc > buf && *esc != 0x1b; esc-- ) { }
+    if ( *esc != 0x1b || sscanf(esc, "\33[%d;%dR", &row, &col) != 2 )
+        esc = buf + n;                          // no reply, all typeahead
+    if ( rs->inpos == rs->inlen ) rs->inpos = rs->inlen = 0;
+    n = MIN((int)(esc - buf), INBUF_SIZE - rs->inlen);
+    memcpy(rs->inbuf + rs->inlen, buf, n);
+    rs->inlen += n;
+    if ( *esc != 0x1b ) return 0;
+    *w = col;
+    *h = row;
+    return 1;
+#else
+    struct text_info ti;
+    rs = rs;                            // unused
+    gettextinfo(&ti);
+    *w = ti.screenwidth;
+    *h = ti.screenheight;
+    return 1;
+#endif
+}
+
+static ReadlineTerm term_ansi = {
+    ansi_read, ansi_put, cursor_pos, ansi_clear, ansi_scroll, out_flush,
+    ansi_begin, ansi_end, ansi_size
+};
+
+// RETURN ANSI TERMINAL BACKEND
+Public const ReadlineTerm* readline_term_ansi(void)
+{
+    return &term_ansi;
+}
+
+#ifndef LINUX
+// DOS: PUT 'n' CHARS 's' AT x,y, STRAIGHT INTO VIDEO RAM
+//    Mono and color video ram both get the chars, whichever is shown.
+//
+Local void dos_put(Readline *rs, int x, int y, const char *s, int n)
+{
+    uchar far *mono = MK_FP(0xb000, (y*rs->scrn_w+x)*2);
+    uchar far *cga  = MK_FP(0xb800, (y*rs->scrn_w+x)*2);
+    for ( ; n > 0; n--, s++ ) {
+        *mono++ = *s; *mono++ = 0x07;   // 'normal' attribute
+        *cga++  = *s; *cga++  = 0x07;
+    }
+}
+
+// DOS: MOVE CURSOR TO x,y
+Local void dos_move(Readline *rs, int x, int y)
+{
+    rs = rs;                            // unused
+    gotoxy(x+1, y+1);                   // TC: 1 based
+}
+
+// DOS: CLEAR x,y THRU ex,ey
+Local void dos_clear(Readline *rs, int x, int y, int ex, int ey)
+{
+    static char blanks[] = "                                        "
+                           "                                        ";
+    int n;
+    for ( ; y <= ey; y++, x = 0 ) {
+        n = ((y == ey) ? ex+1 : rs->scrn_w) - x;
+        while ( n > 0 ) {                       // (132 col modes)
+            dos_put(rs, x, y, blanks, MIN(n, 80));
+            x += 80; n -= 80;
+        }
+    }
+}
+
+// DOS: SCROLL SCREEN UP 'lines' LINES
+//    A whole screen or more just clears it.
+//
+Local void dos_scroll(Readline *rs, int lines)
+{
+    int keep, row = rs->scrn_w * 2;     // bytes per row
+    lines = MAX(0, MIN(lines, rs->scrn_h));
+    if ( lines == 0 ) return;
+    keep = rs->scrn_h - lines;
+    if ( keep > 0 ) {
+        movedata(0xb000, lines*row, 0xb000, 0, keep*row);
+        movedata(0xb800, lines*row, 0xb800, 0, keep*row);
+    }
+    dos_clear(rs, 0, keep, rs->scrn_w-1, rs->scrn_h-1);
+}
+
+// DOS: NOTHING TO DO (VIDEO RAM IS THE SCREEN)
+Local void dos_nop(Readline *rs)
+{
+    rs = rs;                            // unused
+}
+
+static ReadlineTerm term_dos = {
+    ansi_read, dos_put, dos_move, dos_clear, dos_scroll, dos_nop,
+    dos_nop, dos_nop, ansi_size
+};
+
+// RETURN DOS VIDEO RAM BACKEND
+Public const ReadlineTerm* readline_term_dos(void)
+{
+    return &term_dos;
+}
+#endif
+
+// MEMORY: READ KEYS FROM RLMemTerm's 'in'
+//    Once they run out, it's like a tty's EOF.
+//
+Local int mem_read(Readline *rs, char *buf, int size, int timeout)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    int n = MIN(size, m->inlen - m->inpos);
+    if ( n <= 0 ) return timeout >= 0 ? 0 : RL_READ_EOF;
+    memcpy(buf, m->in + m->inpos, n);
+    m->inpos += n;
+    return n;
+}
+
+// MEMORY: PUT 'n' CHARS 's' AT x,y
+Local void mem_put(Readline *rs, int x, int y, const char *s, int n)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    int  len, w;
+    long id;
+    if ( y < 0 || y >= m->h ) return;
+    if ( ascii_len(s, n) == n ) {               // a byte a cell
+        n = MIN(n, m->w - x);
+        if ( n > 0 ) memcpy(m->cells + y*m->w + x, s, n);
+        m->cellsput += n;
+        return;
+    }
+    for ( ; n > 0 && x < m->w; s+=len,n-=len ) {
+        len = str_glyph(rs, s, n, &id, &w);
+        if ( w > 0 ) m->cells[y*m->w + x++] = ( len == 1 ) ? *s : '?';
+        if ( w > 1 && x < m->w ) m->cells[y*m->w + x++] = ' ';
+        m->cellsput += w;
+    }
+}
+
+// MEMORY: MOVE CURSOR TO x,y
+Local void mem_move(Readline *rs, int x, int y)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    m->curx = x;
+    m->cury = y;
+}
+
+// MEMORY: CLEAR x,y THRU ex,ey
+Local void mem_clear(Readline *rs, int x, int y, int ex, int ey)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    long from = (long)y * m->w + x, to = (long)ey * m->w + ex + 1;
+    from = MAX(from, 0);
+    to   = MIN(to, (long)m->w * m->h);
+    if ( from < to ) memset(m->cells + from, ' ', (size_t)(to - from));
+}
+
+// MEMORY: SCROLL SCREEN UP 'lines' LINES
+//    A whole screen or more just clears it.
+//
+Local void mem_scroll(Readline *rs, int lines)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    int keep;
+    lines = MAX(0, MIN(lines, m->h));
+    keep  = m->h - lines;
+    memmove(m->cells, m->cells + lines * m->w, (size_t)keep * m->w);
+    memset(m->cells + keep * m->w, ' ', (size_t)lines * m->w);
+}
+
+// MEMORY: COUNT FRAMES
+Local void mem_flush(Readline *rs)
+{
+    ++((RLMemTerm*)rs->termdata)->flushes;
+}
+
+// MEMORY: NOTHING TO DO
+Local void mem_nop(Readline *rs)
+{
+    rs = rs;                            // unused
+}
+
+// MEMORY: SCREEN SIZE IS RLMemTerm's
+Local int mem_size(Readline *rs, int *w, int *h)
+{
+    RLMemTerm *m = (RLMemTerm*)rs->termdata;
+    *w = m->w;
+    *h = m->h;
+    return 1;
+}
+
+static ReadlineTerm term_mem = {
+    mem_read, mem_put, mem_move, mem_clear, mem_scroll, mem_flush,
+    mem_nop, mem_nop, mem_size
+};
+
+// RETURN MEMORY BACKEND
+//    Set rs->termdata to an RLMemTerm with its cells, w, h and input set.
+//
+Public const ReadlineTerm* readline_term_mem(void)
+{
+    return &term_mem;
+}
+
+// SEND ANY CELLS COLLECTED IN THE SPAN TO THE TERMINAL
+Local void span_flush(Readline *rs)
+{
+    if ( rs->spanlen == 0 ) return;
+    rs->term->put(rs, rs->spanx, rs->spany, rs->span, rs->spanlen);
+    rs->spanlen   = 0;
+    rs->spancells = 0;
+}
+
+// PLOT CHAR 'c' AT POSITION x,y (ZERO BASED)
+//    Runs of cells along a row are collected, and go to the
+//    terminal as one put().
+//
+Local void Plot(Readline *rs, int x, int y, char c)
+{
+    STAT(rs, cells, 1);
+    if ( rs->spanlen &&
+         ( y != rs->spany || x != rs->spanx + rs->spancells ||
+           rs->spanlen == SPAN_SIZE ) )
+        span_flush(rs);
+    if ( rs->spanlen == 0 ) { rs->spanx = x; rs->spany = y; }
+    rs->span[rs->spanlen++] = c;
+    rs->spancells++;
+}
+
+// PLOT UTF-8 CHAR 's' ('n' BYTES, 'w' CELLS) AT POSITION x,y
+//    Like Plot(), for a char that isn't one byte a cell.
+//
+Local void plot_glyph(Readline *rs, int x, int y, const char *s, int n, int w)
+{
+    STAT(rs, cells, w);
+    if ( rs->spanlen &&
+         ( y != rs->spany || x != rs->spanx + rs->spancells ||
+           rs->spanlen + n > SPAN_SIZE ) )
+        span_flush(rs);
+    if ( rs->spanlen == 0 ) { rs->spanx = x; rs->spany = y; }
+    memcpy(rs->span + rs->spanlen, s, n);
+    rs->spanlen   += n;
+    rs->spancells += w;
+}
+
+// 80 //////////////////////////////////////////////////////////////////////////
+
+// CONVERT CELL INDEX 'i' TO SCREEN (x,y)
+//    Cells are numbered from the prompt's x,y position, wrapping
+//    to the left edge of the next screen line. Rows scrolled off the
+//    top (rs->frametop) give a 'y' less than 0.
+//
+Local void cell_xy(Readline *rs, int i, int *xp, int *yp)
+{
+    int pos = rs->promptx + i;
+    *xp = pos % rs->scrn_w;
+    *yp = rs->prompty - rs->frametop + pos / rs->scrn_w;
+}
+
+// FRAME CELLS ON SCREEN: 'lo' UP TO 'hi'
+//    All of them, unless the line is taller than the screen.
+//
+Local void cells_shown(Readline *rs, int *lop, int *hip)
+{
+    int top = rs->prompty - rs->frametop;       // screen row of frame's row 0
+    *lop = MAX(0, -top * rs->scrn_w - rs->promptx);
+    *hip = (rs->scrn_h - top) * rs->scrn_w - rs->promptx;
+}
+
+// NUMBER OF CELLS A TAB TAKES WHEN DRAWN AT CELL 'i'
+//    Draw tab as spaces up to 8th column, or the screen's right edge.
+//
+Local int tab_cells(Readline *rs, int i)
+{
+    int x  = (rs->promptx + i) % rs->scrn_w;
+    int nx = MIN((x/8+1)*8, rs->scrn_w);
+    return nx - x;
+}
+
+// NUMBER OF CELLS TO SKIP BEFORE A CHAR 'w' CELLS WIDE AT CELL 'i'
+//    A wide char can't start in the screen's last column; it goes
+//    to the next row, leaving a blank. (Not if the line is viewed
+//    sideways: it has no rows then.)
+//
+Local int wide_pad(Readline *rs, int i, int w)
+{
+    if ( w != 2 ) return 0;
+    if ( rs->hscroll && rs->colvalid > 0 &&
+         rs->scrn_w - rs->promptx - rs->cols[0] >= VIEW_MIN ) return 0;
+    return ( (rs->promptx + i) % rs->scrn_w == rs->scrn_w - 1 );
+}
+
+// CELLS STRING 's' ('n' BYTES) TAKES, DRAWN AT CELL 'i' (TABS, WIDE CHARS)
+// Returns:
+//    Cell after it
+//
+Local int text_cells(Readline *rs, int i, const char *s, int n)
+{
+    int  len, w;
+    long id;
+    for ( ; n>0; s+=len,n-=len ) {
+        len = 1;
+        if      ( *s == 0x09 ) i += tab_cells(rs, i);
+        else if ( (uchar)*s < 0x80 || ! rs->utf8 ) ++i;
+        else {
+            len = str_glyph(rs, s, n, &id, &w);
+            i  += wide_pad(rs, i, w) + w;
+        }
+    }
+    return i;
+}
+
+// LAY OUT ASCII LINE CHARS FROM rs->colvalid-1 UP TO 'end', ALL IN SPAN 's'
+//    's' is indexed by line position. Jumps from tab to tab: the chars
+//    between take a cell each.
+//
+Local void layout_run(Readline *rs, const char *s, int end)
+{
+    int i    = rs->colvalid-1;                  // char 'i' gives cols[i+1]
+    int cell = rs->cols[i], e;
+    while ( i < end ) {
+        if ( s[i] == 0x09 ) {
+            rs->cols[i+1] = cell += tab_cells(rs, cell);
+            ++i;
+            continue;
+        }
+        e = i + tab_run(s + i, end - i);
+        while ( i < e ) rs->cols[++i] = ++cell;
+    }
+    rs->colvalid = end+1;
+}
+
+// UPDATE LAYOUT CACHE UP TO LINE POSITION 'upto'
+//
+//    rs->cols[i] is the cell index of line char 'i', so the prompt
+//    is cells 0 thru cols[0]-1, and cols[linelen] is the cell after eol.
+//    This is what tells us how many screen wraps the line makes,
+//    and where the cursor goes.
+//
+//    A char's cell only depends on the chars before it, so edits
+//    just invalidate from the edit point on (see line_dirty()), and
+//    only that part gets recomputed here.
+//
+Local void layout(Readline *rs, int upto)
+{
+    int i, cell;
+
+    // Prompt or screen width changed? Redo it all
+    if ( rs->prompt  != rs->layprompt  ||
+         rs->promptx != rs->laypromptx ||
+         rs->scrn_w  != rs->layscrn_w ) {
+        rs->layprompt  = rs->prompt;
+        rs->laypromptx = rs->promptx;
+        rs->layscrn_w  = rs->scrn_w;
+        rs->colvalid   = 0;
+        rs->dirty      = 0;
+    }
+
+    // Prompt's width (may have tabs)
+    if ( rs->colvalid == 0 ) {
+        rs->cols[0]  = text_cells(rs, 0, rs->prompt, strlen(rs->prompt));
+        rs->colvalid = 1;
+    }
+    if ( upto < rs->colvalid ) return;
+
+    // Line's chars from last valid position on
+    //    All ASCII (the usual)? A byte is a cell, or a tab's cells;
+    //    a long stretch goes tab to tab (see layout_run()).
+    //
+    if ( line_ascii(rs, rs->colvalid-1, upto) ) {
+        if ( upto - rs->colvalid >= SCAN_RUN ) {
+            const char *s;
+            int seg, off, n;
+            for ( seg=0,off=0; seg<2; seg++,off+=n ) {
+                n = line_span(rs, seg, &s);
+                if ( rs->colvalid-1 >= off && rs->colvalid-1 < MIN(upto, off+n) )
+                    layout_run(rs, s - off, MIN(upto, off+n));
+            }
+        }
+        for ( i=rs->colvalid; i<=upto; i++ ) {
+            cell = rs->cols[i-1];
+            rs->cols[i] = cell + ((line_at(rs, i-1) == 0x09) ? tab_cells(rs, cell) : 1);
+        }
+        rs->colvalid = MAX(rs->colvalid, upto+1);
+        return;
+    }
+
+    // UTF-8: a char at a time, from the char before the change (a wide
+    //    char being padded to the next row moved that char's cell)
+    //
+    i = char_start(rs, rs->colvalid-1);
+    if ( i > 0 ) i = char_start(rs, i-1);
+    while ( i < upto ) {
+        long cp;
+        int  n, w;
+        cell = rs->cols[i];
+        if ( line_at(rs, i) == 0x09 ) {
+            n = 1;
+            cell += tab_cells(rs, cell);
+        } else {
+            n = line_char(rs, i, &cp, &w);
+            rs->cols[i] = cell += wide_pad(rs, cell, w);
+            cell += w;
+        }
+        while ( n-- > 0 ) rs->cols[++i] = cell;     // tail bytes: cell after
+    }
+    rs->colvalid = i+1;
+}
+
+// MAKE SURE SHADOW HAS ROOM FOR 'n' CELLS
+Local void shadow_room(Readline *rs, int n)
+{
+    if ( n <= rs->shadowsize ) return;
+    rs->shadowsize = n + rs->scrn_w;            // grow (rare; long tabs)
+    rs->shadow = (long*)realloc(rs->shadow, sizeof(long) * rs->shadowsize);
+}
+
+// CARRY THE SPAN ACROSS UNCHANGED CELLS BEFORE CELL 'i' (AT x,y)
+//    Skipping them costs a cursor move (ESC[y;xH); if that's no
+//    shorter than the cells, they're rewritten from the shadow instead
+//    and the run goes on. Only plain ASCII cells are rewritten.
+//
+Local void span_gap(Readline *rs, int i, int x, int y)
+{
+    int gap = x - (rs->spanx + rs->spancells), k;
+    long c;
+    if ( rs->spanlen == 0 || y != rs->spany || gap <= 0 || gap > i ) return;
+    if ( gap > 6 + (x >= 9) + (x >= 99) + (y >= 9) + (y >= 99) ) return;
+    if ( rs->spanlen + gap >= SPAN_SIZE ) return;
+    for ( k=i-gap; k<i; k++ )
+        if ( (c = rs->shadow[k]) < ' ' || c >= 0x7f ) return;
+    for ( k=i-gap; k<i; k++ )
+        Plot(rs, x - (i-k), y, (char)rs->shadow[k]);
+}
+
+// PLOT CHAR 'c' INTO CELL 'i' OF THE FRAME
+//    Skips the plot if the shadow says the cell already shows 'c'.
+//    Cells are drawn in order, so the known part of the shadow
+//    grows one cell at a time. A cell off the screen isn't plotted;
+//    the shadow marks it to be, once it's on.
+//
+Local void frame_cell(Readline *rs, int i, char c)
+{
+    int x, y;
+    if ( i < rs->shadowlen && rs->shadow[i] == (uchar)c ) return;  // unchanged
+    shadow_room(rs, i+1);
+    if ( i == rs->shadowlen ) ++rs->shadowlen;
+    cell_xy(rs, i, &x, &y);
+    if ( y < 0 || y >= rs->scrn_h ) { rs->shadow[i] = CELL_REDRAW; return; }
+    rs->shadow[i] = (uchar)c;
+    span_gap(rs, i, x, y);
+    Plot(rs, x, y, c);
+}
+
+// PLOT GLYPH 's' ('n' BYTES, 'w' CELLS) INTO CELL 'i' OF THE FRAME
+//    'id' is its code point, -1 to show '?' instead, or CELL_REDRAW.
+//    A wide char's second cell is CELL_TAIL in the shadow.
+//
+Local void frame_glyph(Readline *rs, int i, const char *s, int n, int w, long id)
+{
+    int x, y;
+    if ( id == -1 ) { s = "?"; n = 1; id = '?'; }
+    if ( n == 1 && (uchar)*s < 0x80 ) { frame_cell(rs, i, *s); return; }
+    if ( id != CELL_REDRAW && i + w <= rs->shadowlen && rs->shadow[i] == id &&
+         ( w == 1 || rs->shadow[i+1] == CELL_TAIL ) ) return;   // unchanged
+    shadow_room(rs, i+w);
+    if ( i <= rs->shadowlen ) rs->shadowlen = MAX(rs->shadowlen, i+w);
+    cell_xy(rs, i, &x, &y);
+    if ( y < 0 || y >= rs->scrn_h ) {           // off screen
+        rs->shadow[i] = CELL_REDRAW;
+        if ( w == 2 ) rs->shadow[i+1] = CELL_REDRAW;
+        return;
+    }
+    rs->shadow[i] = id;
+    if ( w == 2 ) rs->shadow[i+1] = CELL_TAIL;
+    span_gap(rs, i, x, y);
+    plot_glyph(rs, x, y, s, n, w);
+}
+
+// CLEAR CELLS 'from' UP TO 'to' OF THE FRAME
+Local void clear_cells(Readline *rs, int from, int to)
+{
+    int x, y, ex, ey, lo, hi;
+    if ( from >= to ) return;
+    shadow_room(rs, to);
+    if ( from > 0 && from < rs->shadowlen && rs->shadow[from] == CELL_TAIL )
+        rs->shadow[from-1] = CELL_REDRAW;       // half a wide char: both go
+    cells_shown(rs, &lo, &hi);
+    for ( x=from; x<to; x++ )
+        rs->shadow[x] = ( x >= lo && x < hi ) ? ' ' : CELL_REDRAW;
+    rs->shadowlen = MAX(rs->shadowlen, to);
+    from = MAX(from, lo);                       // just what's on screen
+    to   = MIN(to, hi);
+    if ( from >= to ) return;
+    span_flush(rs);
+    cell_xy(rs, from, &x, &y);
+    cell_xy(rs, to-1, &ex, &ey);
+    rs->term->clear(rs, x, y, ex, ey);
+}
+
+// DRAW 'n' BYTES OF STRING INTO FRAME AT CELL *ip, LEAVING *ip ADJUSTED
+//    Takes the cells text_cells() says.
+//
+Local void Draw(Readline *rs, int *ip, const char *s, int n)
+{
+    int i = *ip, t, len, w;
+    long id;
+    for ( ; n>0; s+=len,n-=len ) {
+        // Run of chars a cell each: up to the next tab, and with UTF-8,
+        //    short of the char before a non-ASCII byte (may be a mark on it)
+        len = tab_run(s, n);
+        if ( rs->utf8 && (t = ascii_len(s, len)) < len ) len = MAX(t-1, 0);
+        for ( t=0; t<len; t++ ) frame_cell(rs, i++, s[t]);
+        if ( len == n ) break;
+        s += len; n -= len;
+        len = 1;
+        // Special case for TAB character
+        if ( *s == 0x09 ) {
+            for ( t = tab_cells(rs, i); t > 0; t-- )
+                frame_cell(rs, i++, ' ');
+            continue;
+        }
+        len = str_glyph(rs, s, n, &id, &w);
+        if ( wide_pad(rs, i, w) ) frame_cell(rs, i++, ' ');
+        if ( w ) frame_glyph(rs, i, s, len, w, id);
+        i += w;
+    }
+    *ip = i;
+}
+
+// DRAW LINE CHAR AT POSITION 'i' INTO FRAME, 'shift' CELLS OVER FROM cols[]
+//    Only cells 'lo' thru 'hi'-1 are drawn; a wide char cut by those
+//    shows as blanks. Cells between it and the next char (a wide char's
+//    pad) are blanked, and marks are drawn with the char before them.
+// Returns:
+//    Bytes of line it took
+//
+Local int draw_char(Readline *rs, int i, int shift, int lo, int hi)
+{
+    char g[GLYPH_MAX];
+    int  n, len, w, cell, end;
+    long id;
+    if ( line_tail(rs, i) || line_mark(rs, i) ) {
+        len = 1;                                // stray tail byte, or mark
+        n   = 0;
+        if ( line_mark(rs, i) ) len = line_char(rs, i, &id, &w);
+        else                    n = 1, g[0] = '?', id = -1, w = 1;
+    } else {
+        n   = line_get(rs, i, g, GLYPH_MAX);
+        len = str_char(rs, g, n, &id, &w);
+        n   = str_glyph(rs, g, n, &id, &w);     // with its marks
+    }
+    cell = rs->cols[i] + shift;
+    end  = rs->cols[i+len] + shift;
+    if ( i == 0 && w == 2 && cell - 1 >= lo &&
+         text_cells(rs, 0, rs->prompt, strlen(rs->prompt)) < rs->cols[0] )
+        frame_cell(rs, cell - 1, ' ');          // pad after prompt
+    if ( n && w && cell >= lo && cell + w <= hi ) {
+        frame_glyph(rs, cell, g, n, w, id);
+        cell += w;
+    }
+    for ( cell=MAX(cell, lo); cell<MIN(end, hi); cell++ )
+        frame_cell(rs, cell, ' ');
+    return len;
+}
+
+// DRAW LINE POSITIONS 'from' UP TO 'to' INTO THE FRAME
+//    Draws the spans on either side of the gap, at the cells
+//    the layout cache says each char goes. 'from' must start a char.
+//
+Local void draw_line(Readline *rs, int from, int to)
+{
+    int seg, n, off, i, e, cell, ascii = line_ascii(rs, from, to);
+    const char *s;
+    for ( seg=0,off=0; seg<2; seg++,off+=n ) {
+        n = line_span(rs, seg, &s);
+        for ( i=MAX(from, off); i<MIN(to, off+n); ) {
+            if ( ascii && s[i-off] != 0x09 ) {  // ASCII up to next tab
+                e = i + tab_run(s + i-off, MIN(to, off+n) - i);
+                for ( cell=rs->cols[i]; i<e; i++ )
+                    frame_cell(rs, cell++, s[i-off]);
+            } else if ( s[i-off] == 0x09 ) {    // tab? spaces to next char
+                for ( cell=rs->cols[i]; cell<rs->cols[i+1]; cell++ )
+                    frame_cell(rs, cell, ' ');
+                i++;
+            } else if ( ascii || ( (uchar)s[i-off] < 0x80 &&
+                        ( i+1 >= rs->linelen || (uchar)line_at(rs, i+1) < 0x80 ) ) ) {
+                frame_cell(rs, rs->cols[i], s[i-off]);
+                if ( ! ascii && rs->cols[i+1] > rs->cols[i] + 1 )
+                    frame_cell(rs, rs->cols[i] + 1, ' ');   // wide char's pad
+                i++;
+            } else {
+                i += draw_char(rs, i, 0, 0, rs->cols[rs->linelen]);
+            }
+        }
+        from = i;                               // (char may span the gap)
+    }
+}
+
+// HSCROLL: LINE POSITION THE VIEW CAN'T REACH PAST
+//    A cell per byte, or with UTF-8, up to four bytes a cell.
+//
+Local int view_upto(Readline *rs, int view)
+{
+    long most = (long)rs->curpos + (rs->utf8 ? 4L : 1L) * view + 1;
+    return (int)MIN((long)rs->linelen, most);
+}
+
+// HSCROLL: MOVE LINE'S VIEW JUST ENOUGH TO KEEP THE CURSOR IN IT
+//    The view is 'view' cells from line char rs->viewstart on. Its first
+//    cell shows '<' if it doesn't start at the beginning of the line,
+//    its last '>' if there's more past it, so the cursor stays clear
+//    of those. Lays out the line only as far as the view can reach.
+// Returns:
+//    Frame cell of the cursor
+//
+Local int view_move(Readline *rs, int view)
+{
+    int need, target, lo, hi, mid;
+    layout(rs, view_upto(rs, view));
+
+    // Edit made the view's first char part of the one before? Start there
+    if ( rs->utf8 && rs->viewstart < rs->linelen &&
+         (lo = char_prev(rs, rs->viewstart+1)) < rs->viewstart )
+        rs->viewstart = lo;
+
+    // Cursor left of view (or under '<')? Start view just before it
+    if ( rs->curpos < rs->viewstart ||
+         ( rs->viewstart > 0 && rs->curpos == rs->viewstart ) )
+        rs->viewstart = char_prev(rs, rs->curpos);
+
+    // Cursor right of view (or under '>')? Binary search cols[] for
+    // the first char the view can start at and still reach it
+    //
+    need   = (rs->curpos < rs->linelen) ? 2 : 1;  // cursor's cell, and '>'
+    target = rs->cols[rs->curpos] + need - view;
+    if ( rs->cols[rs->viewstart] < target ) {
+        lo = rs->viewstart;
+        hi = rs->curpos;
+        while ( lo < hi ) {
+            mid = (lo + hi) / 2;
+            if ( rs->cols[mid] < target ) lo = mid + 1;
+            else                          hi = mid;
+        }
+        if ( (mid = char_prev(rs, lo+1)) < lo ) // inside a char? the next one
+            lo = char_next(rs, mid);
+        if ( lo > 0 && lo == rs->curpos )       // wide tab: keep clear of '<'
+            lo = char_prev(rs, lo);
+        rs->viewstart = lo;
+    }
+    return rs->cols[0] + rs->cols[rs->curpos] - rs->cols[rs->viewstart];
+}
+
+// HSCROLL: DRAW THE LINE'S VIEW INTO THE FRAME
+//    Only the view's cells are touched, however long the line is.
+// Returns:
+//    Frame cells used (prompt + view)
+//
+Local int view_draw(Readline *rs, int view)
+{
+    int c0    = rs->cols[0];                    // view's first frame cell
+    int left  = rs->cols[rs->viewstart];        // view shows line cells
+    int right = left + view;                    //    left thru right-1
+    int upto  = view_upto(rs, view);            // laid out
+    int more  = ( upto < rs->linelen || rs->cols[upto] > right );
+    int lo    = c0 + (rs->viewstart > 0);       // cells lo thru hi-1
+    int hi    = c0 + view - more;               //    show line's chars
+    int ascii = line_ascii(rs, rs->viewstart, upto);
+    int i, cell, e;
+    char c;
+
+    if ( lo > c0 ) frame_cell(rs, c0, '<');
+    for ( i=rs->viewstart;
+          i < upto && (cell = c0 + rs->cols[i] - left) < hi; i++ ) {
+        c = line_at(rs, i);
+        if ( c == 0x09 ) {                      // tab? spaces to next char
+            e = MIN(c0 + rs->cols[i+1] - left, hi);
+            for ( ; cell < e; cell++ )
+                if ( cell >= lo ) frame_cell(rs, cell, ' ');
+        } else if ( ! ascii && ( (uchar)c >= 0x80 ||
+                    ( i+1 < rs->linelen && (uchar)line_at(rs, i+1) >= 0x80 ) ) ) {
+            i += draw_char(rs, i, c0 - left, lo, hi) - 1;
+        } else if ( cell >= lo ) {
+            frame_cell(rs, cell, c);
+            if ( ! ascii && rs->cols[i+1] > rs->cols[i] + 1 && cell + 1 < hi )
+                frame_cell(rs, cell + 1, ' ');  // wide char's pad
+        }
+    }
+    if ( ! more ) return c0 + rs->cols[rs->linelen] - left;
+    frame_cell(rs, hi, '>');
+    return c0 + view;
+}
+
+// RETURN CANDIDATE 'i' FOR THE WORD BEING COMPLETED (0 IF NO MORE)
+Local const char* comp_get(Readline *rs, long i)
+{
+    if ( rs->complete )
+        return rs->complete(rs, rs->compword, rs->compwordlen, i);
+    return ( i < rs->compn ) ? rs->carena + rs->cword[rs->complo + i] : 0;
+}
+
+// LAY OUT A PAGE OF THE CANDIDATE LIST, STARTING AT listpos
+//    Columns are as wide as the longest candidate on the page.
+//    At most 'maxrows' rows, so the page fits on the screen.
+//
+Local void list_layout(Readline *rs, int maxrows)
+{
+    long i, most;
+    int len;
+    const char *s;
+    rs->listrows = MIN(LIST_ROWS, rs->scrn_h / 2);
+    rs->listrows = MAX(1, MIN(rs->listrows, maxrows));
+    most = (long)rs->listrows * (rs->scrn_w / 3);   // columns >= 3 wide
+    rs->listcolw = 3;
+    for ( i=0; i<most && rs->listpos + i < rs->compn; i++ ) {
+        s   = comp_get(rs, rs->listpos + i);
+        len = text_cells(rs, 0, s, strlen(s));
+        rs->listcolw = MAX(rs->listcolw, len + 2);
+    }
+    rs->listcolw = MIN(rs->listcolw, rs->scrn_w);
+    rs->listcols = rs->scrn_w / rs->listcolw;
+    rs->listn    = MIN((long)rs->listrows * rs->listcols,
+                       rs->compn - rs->listpos);
+    rs->listrows = (int)((rs->listn + rs->listcols - 1) / rs->listcols);
+}
+
+// FRAME CELL STARTING THE ROW BELOW CELL 'end'
+Local int list_start(Readline *rs, int end)
+{
+    return ((rs->promptx + end) / rs->scrn_w + 1) * rs->scrn_w - rs->promptx;
+}
+
+// NUMBER OF ROWS THE LISTED PAGE TAKES (WITH ITS "more" ROW)
+Local int list_rows(Readline *rs)
+{
+    return rs->listrows + (rs->listpos + rs->listn < rs->compn);
+}
+
+// DRAW PAGE OF CANDIDATE LIST INTO FRAME, ON ROWS BELOW CELL 'end'
+//    Candidates go down the columns, like 'ls'.
+// Returns:
+//    Frame cells used
+//
+Local int list_draw(Readline *rs, int end)
+{
+    int w = rs->scrn_w, start = list_start(rs, end);
+    int r, c, i = end, n;
+    long k;
+    const char *s;
+    char more[80];
+    while ( i < start ) frame_cell(rs, i++, ' ');
+    for ( r=0; r<rs->listrows; r++ ) {
+        for ( c=0; c<rs->listcols; c++ ) {
+            k = (long)c * rs->listrows + r;
+            s = ( k < rs->listn ) ? comp_get(rs, rs->listpos + k) : "";
+            n = str_fit(rs, s, strlen(s), rs->listcolw - 2);
+            Draw(rs, &i, s, n);
+            while ( i < start + r*w + (c+1)*rs->listcolw )
+                frame_cell(rs, i++, ' ');
+        }
+        while ( i < start + (r+1)*w ) frame_cell(rs, i++, ' ');
+    }
+    if ( list_rows(rs) > rs->listrows ) {
+        sprintf(more, "-- %ld more, TAB for next page --",
+                rs->compn - rs->listpos - rs->listn);
+        Draw(rs, &i, more, MIN((int)strlen(more), w));
+        while ( i < start + (r+1)*w ) frame_cell(rs, i++, ' ');
+    }
+    return i;
+}
+
+// FORCE PAGE TO SCROLL UP 'lines' LINES
+Local void scroll_up(Readline *rs, int lines)
+{
+    span_flush(rs);
+    rs->term->scroll(rs, lines);
+}
+
+// REDRAW LINE AT PROMPT
+//    Draw directly to the screen to prevent cursor chatter.
+//    Caller does the rs->term->flush() to send out the frame.
+//
+Local void redraw_line(Readline *rs)
+{
+    int end, curi, x, y;
+    int top, cur_y, new_y, max_y;
+    int view;                           // cells for line's view (0=wrap)
+    int last;                           // last cell of frame
+
+    // Cells for line up to eol; only what changed since last frame
+    //    Viewing it sideways? Just as far as the view can reach.
+    //
+    layout(rs, 0);
+    view = rs->scrn_w - rs->promptx - rs->cols[0];
+    if ( ! rs->hscroll || view < VIEW_MIN ) view = 0;
+    if ( view ) {
+        curi = view_move(rs, view);
+        end  = curi;                    // (all on prompt's row)
+    } else {
+        layout(rs, rs->linelen);
+        end  = rs->cols[rs->linelen];   // like strlen but includes tabs
+        curi = rs->cols[rs->curpos];    // cell under cursor
+    }
+
+    // IF LINE WOULD RUN OFF EDGE OF LAST LINE OF SCREEN, ADJUST PROMPTY
+    //
+    //   Once adjusted, subsequent calls won't retrigger this code
+    //   because prompty is now /adjusted/, taking into account the
+    //   scrolling that will happen when the line is actually printed.
+    //
+    //   A line taller than the screen can't all show: the cursor's
+    //   row stays on screen, and rows above the top (rs->frametop)
+    //   or below the bottom just aren't drawn.
+    //
+    last = end;
+    if ( rs->listing ) {                // completions listed below line
+        if ( rs->literal ) end = MAX(end, curi+1);
+        // Rows left below the line, keeping the cursor's row on
+        //    screen, less one for the "more" row
+        x = (rs->promptx + end) / rs->scrn_w - (rs->promptx + curi) / rs->scrn_w;
+        list_layout(rs, rs->scrn_h - 2 - x);
+        last = list_start(rs, end) + list_rows(rs) * rs->scrn_w - 1;
+    }
+    top   = rs->prompty - rs->frametop;         // screen row of prompt's row
+    cur_y = top + (rs->promptx + curi) / rs->scrn_w;
+    new_y = top + (rs->promptx + last) / rs->scrn_w;
+    max_y = (rs->scrn_h-1);
+
+    rs->framebytes = 0;                     // start counting a new frame
+    STAT(rs, frames, 1);
+    if ( cur_y < 0 ) {
+        // Cursor went up past the top? Screen can't scroll down,
+        // so move the frame down and draw all of it again
+        top -= cur_y;
+        rs->shadowlen = 0;
+        rs->dirty     = 0;
+    } else if ( new_y > max_y ) {
+        int diff = MIN(new_y - max_y, cur_y);   // (keep cursor on screen)
+        int lo, hi;
+        // Rows the last frame had below the screen come on: draw them
+        cells_shown(rs, &lo, &hi);
+        if ( hi < rs->drawnlen ) rs->dirty = 0;
+        // Adjust prompty to be higher now that screen scrolled up
+        top -= diff;
+        scroll_up(rs, MIN(diff, rs->scrn_h));
+    }
+    rs->prompty  = MAX(top, 0);
+    rs->frametop = MAX(-top, 0);
+
+    // DRAW PROMPT AND LINE, PLOTTING ONLY CELLS THAT CHANGED
+    //    Cells before the first edit since last frame can't have changed.
+    //
+    if ( rs->shadowlen == 0 ) rs->dirty = 0;    // nothing on screen yet
+    if ( rs->dirty == 0 ) {
+        int i = 0;
+        Draw(rs, &i, rs->prompt, strlen(rs->prompt));   // DRAW PROMPT
+    }
+    if ( view ) {
+        end = view_draw(rs, view);
+    } else {
+        int from = MIN(rs->dirty, rs->linelen);
+        // UTF-8 chars? The edit may have split or joined the char before
+        //    it, or changed its marks; draw from that char, and if it
+        //    isn't ASCII the one before it too (its pad may change)
+        if ( rs->utf8 && rs->linehigh && from > 0 )
+            from = ( (uchar)line_at(rs, from-1) < 0x80 ) ? from-1 :
+                   char_prev(rs, char_start(rs, from-1));
+        draw_line(rs, from, rs->linelen);
+    }
+    if ( rs->literal ) {
+        frame_cell(rs, curi, '^');          // put caret under cursor
+        end = MAX(end, curi+1);
+    }
+    if ( rs->listing ) end = list_draw(rs, end);
+    // Next frame starts clean, except for the char under the caret
+    rs->dirty = rs->literal ? rs->curpos : rs->maxline;
+
+    // Blank only the cells the last frame drew past our end
+    clear_cells(rs, end, rs->drawnlen);
+    rs->drawnlen = end;
+
+    // Drew onto a row we know nothing about? Clear rest of that row
+    x = (rs->promptx + rs->shadowlen) % rs->scrn_w;
+    if ( x != 0 )
+        clear_cells(rs, rs->shadowlen, rs->shadowlen + rs->scrn_w - x);
+
+    // LEAVE CURSOR AT INSERT POINT
+    span_flush(rs);
+    cell_xy(rs, curi, &x, &y);
+    rs->term->move(rs, x, y);
+    rs->cursorx = x;
+    rs->cursory = y;
+}
+
+// SCREEN IS NOW 'w' x 'h'
+//    readline() finds this out itself (rs->termsize); an app using
+//    readline_feed() with its own SIGWINCH handling can call this.
+//    Width changes rewrap the line, so the rows it was on get cleared
+//    and it's drawn again; a height change alone needs no redraw unless
+//    the prompt's row went off the bottom.
+//
+Public void readline_resize(Readline *rs, int w, int h)
+{
+    int rows, y;
+    if ( w <= 0 || h <= 0 || (w == rs->scrn_w && h == rs->scrn_h) ) return;
+    rows = rs->drawnlen ? (rs->promptx + rs->drawnlen - 1) / rs->scrn_w + 1 : 0;
+    if ( w != rs->scrn_w ) rs->shadowlen = 0;   // layout() redoes cols[]
+    rs->scrn_w  = w;
+    rs->scrn_h  = h;
+    rs->promptx = MIN(rs->promptx, w-1);
+    if ( rs->prompty >= h ) {
+        rs->prompty = h-1;
+        rs->shadowlen = 0;
+    }
+    if ( rs->frametop ) rs->shadowlen = 0;      // tall line: rows shown change
+    rs->saveprompty = MIN(rs->saveprompty, h-1);    // (ENTER goes back to it)
+    if ( rs->shadowlen || rows == 0 ) return;   // nothing on screen to fix
+    y = MIN(rs->prompty + rows - 1, h-1);
+    span_flush(rs);
+    rs->term->clear(rs, 0, rs->prompty, w-1, y);    // just the line's rows
+    rs->drawnlen = 0;
+    if ( ! rs->lineready ) {
+        redraw_line(rs);
+        rs->term->flush(rs);
+    }
+}
+
+// ASK TERMINAL ITS SIZE, IF IT MAY HAVE CHANGED
+Local void check_size(Readline *rs)
+{
+    int w, h;
+    rs->checksize = 0;
+    if ( rs->termsize && rs->term->size(rs, &w, &h) )
+        readline_resize(rs, w, h);
+}
+
+////              ///////////////////////////////////////
+//// LINE EDITING ///////////////////////////////////////
+////              ///////////////////////////////////////
+
+// DELETE CHAR AT CURRENT LINE + CURSOR POSITION
+//    (with UTF-8, all its bytes and the marks on it)
+//
+Local void delete_char(Readline *rs)
+{
+    int n;
+    if ( rs->curpos >= rs->linelen ) return;    // nothing under cursor
+    n = char_next(rs, rs->curpos) - rs->curpos;
+    move_gap(rs, rs->curpos);
+    undo_add(rs, rs->curpos, rs->line + rs->gapend, n, 0, 0);
+    rs->gapend  += n;                           // gap swallows char
+    rs->linelen -= n;
+    line_dirty(rs, rs->curpos);
+}
+
+// INSERT CHAR 'c' INTO CURRENT LINE + CURSOR POSITION
+//     Where rs->line is current line, rs->curpos is cursor pos'n
+// Returns:
+//     1 -- char inserted
+//     0 -- line full
+//
+Local int insert_char(Readline *rs, char c)
+{
+    if ( rs->linelen >= rs->maxline-1 ) return 0;   // leave room for NULL
+    move_gap(rs, rs->curpos);
+    undo_add(rs, rs->curpos, 0, 0, &c, 1);
+    rs->line[rs->gapstart++] = c;               // drop in char
+    ++rs->linelen;
+    if ( c & 0x80 ) rs->linehigh = 1;
+    line_dirty(rs, rs->curpos);
+    return 1;
+}
+
+// MOVE CURSOR TO LEFT (IF POSSIBLE)
+//     Won't move into prompt.
+//
+Local void cursor_left(Readline *rs)
+{
+    rs->curpos = char_prev(rs, rs->curpos);
+}
+
+// MOVE CURSOR TO RIGHT (IF POSSIBLE)
+//     Won't advance beyond end of string or maxline
+//
+Local void cursor_right(Readline *rs)
+{
+    rs->curpos = char_next(rs, rs->curpos);
+}
+
+Local void cursor_sol(Readline *rs)
+{
+    rs->curpos = 0;
+}
+
+Local void cursor_eol(Readline *rs)
+{
+    rs->curpos = rs->linelen;
+}
+
+// MOVE CURSOR OFF THE MIDDLE OF A CHAR, TO AFTER IT
+//    An edit can join the bytes on either side of the cursor into
+//    one char, e.g. a char typed in front of a mark.
+//
+Local void cursor_snap(Readline *rs)
+{
+    int p;
+    if ( ! rs->utf8 || ! rs->linehigh || rs->curpos >= rs->linelen ||
+         (uchar)line_at(rs, rs->curpos) < 0x80 ) return;
+    if ( (p = char_prev(rs, rs->curpos+1)) < rs->curpos )
+        rs->curpos = char_next(rs, p);
+}
+
+// MOVE TO FIRST LETTER IN EACH WORD
+//     Look for a letter preceded by whitespace.
+//
+Local void word_right(Readline *rs)
+{
+    int end = rs->linelen;
+    int pos = line_find(rs, char_next(rs, rs->curpos), end, ' ', ' ', 1);
+    for (;;) {
+        pos = line_find(rs, pos, end, ' ', ' ', 0);
+        if ( pos >= end || ! line_mark(rs, pos) ) break;
+        pos = char_next(rs, pos);               // marks go with the space
+        if ( pos >= end || line_at(rs, pos) != ' ' ) break;
+    }
+    rs->curpos = pos;
+}
+
+// RETURN START OF WORD LEFT OF 'pos'
+//     Back over spaces, then over the word's letters.
+//
+Local int word_start(Readline *rs, int pos)
+{
+    pos = line_rfind(rs, 0, pos, ' ', ' ', 0) + 1;
+    return line_rfind(rs, 0, pos, ' ', ' ', 1) + 1;
+}
+
+// RETURN END OF WORD RIGHT OF 'pos'
+//     Over spaces, then over the word's letters.
+//
+Local int word_end(Readline *rs, int pos)
+{
+    pos = line_find(rs, pos, rs->linelen, ' ', ' ', 0);
+    return line_find(rs, pos, rs->linelen, ' ', ' ', 1);
+}
+
+// MOVE TO FIRST LETTER OF WORD LEFT OF CURSOR
+Local void word_left(Readline *rs)
+{
+    rs->curpos = word_start(rs, rs->curpos);
+}
+
+Local void backspace(Readline *rs)
+{
+    if ( rs->curpos > 0 )
+        { cursor_left(rs); delete_char(rs); }
+}
+
+// APPEND A CHARACTER TO LINE AT CURRENT CURSOR POSITION
+//    Insert character at cursor position, then move right.
+//    A UTF-8 char comes a byte at a time, so this steps a byte.
+//
+Local void append_char(Readline *rs, char c)
+{
+    if ( insert_char(rs, c) ) ++rs->curpos;
+}
+
+// INSERT PASTED TEXT 's' OF 'n' CHARS AT CURSOR, CURSOR AFTER IT
+//    Line breaks become spaces, other control chars are dropped.
+//    Whatever doesn't fit in maxline is lost.
+//
+Local void insert_str(Readline *rs, const char *s, int n)
+{
+    int  pos = rs->curpos;
+    char c, last = 0;
+    move_gap(rs, pos);
+    for ( ; n > 0 && rs->linelen < rs->maxline-1; n-- ) {
+        c = *s++;
+        if ( c == '\n' && last == '\r' ) { last = c; continue; }  // CRLF: one space
+        last = c;
+        if ( c == '\r' || c == '\n' ) c = ' ';
+        else if ( ((uchar)c < ' ' && c != '\t') || c == 0x7f ) continue;
+        rs->line[rs->gapstart++] = c;
+        ++rs->linelen;
+        if ( c & 0x80 ) rs->linehigh = 1;
+    }
+    undo_add(rs, pos, 0, 0, rs->line + pos, rs->gapstart - pos);
+    rs->curpos = rs->gapstart;
+    line_dirty(rs, pos);
+}
+
+// DELETE CHARS 'from' UP TO 'to' FROM LINE, CURSOR TO 'from'
+//    Gap moves to 'from' and swallows the range, so it's the one memmove.
+//
+Local void delete_range(Readline *rs, int from, int to)
+{
+    if ( to <= from ) return;
+    move_gap(rs, from);
+    undo_add(rs, from, rs->line + rs->gapend, to - from, 0, 0);
+    rs->gapend  += to - from;
+    rs->linelen -= to - from;
+    rs->curpos   = from;
+    line_dirty(rs, from);
+}
+
+// INSERT 'n' CHARS 's' AS IS AT CURSOR, CURSOR AFTER THEM
+// Returns:
+//    Chars inserted (what fits in maxline)
+//
+Local int insert_text(Readline *rs, const char *s, int n)
+{
+    int pos = rs->curpos;
+    n = MIN(n, rs->maxline-1 - rs->linelen);    // leave room for NULL
+    if ( n <= 0 ) return 0;
+    move_gap(rs, pos);
+    memcpy(rs->line + rs->gapstart, s, n);
+    if ( ascii_len(s, n) < n ) rs->linehigh = 1;
+    undo_add(rs, pos, 0, 0, s, n);
+    rs->gapstart += n;
+    rs->linelen  += n;
+    rs->curpos    = rs->gapstart;
+    line_dirty(rs, pos);
+    return n;
+}
+
+// REPLACE 'del' CHARS AT 'pos' WITH 'nins' CHARS 'ins', NOT LOGGING IT
+//    For undo/redo, which are replaying the log.
+//
+Local void undo_apply(Readline *rs, int pos, int del, const char *ins, int nins)
+{
+    move_gap(rs, pos);
+    rs->gapend  += del;
+    rs->linelen -= del;
+    memcpy(rs->line + rs->gapstart, ins, nins);
+    if ( ascii_len(ins, nins) < nins ) rs->linehigh = 1;
+    rs->gapstart += nins;
+    rs->linelen  += nins;
+    line_dirty(rs, pos);
+}
+
+////                 ////////////////////////////////////
+//// COMMAND HISTORY ////////////////////////////////////
+////                 ////////////////////////////////////
+
+// The history is a ring buffer of up to histsize lines. Each line
+// pushed gets the next sequence number 'seq', and its index slot is:
+//
+//     hoff[seq % histsize]         for histfirst <= seq < histnext
+//     hlen[seq % histsize]
+//
+// ..so a push just reuses the oldest slot, and getting to any
+// entry is O(1). During up/down navigation, histpos is the seq of the
+// entry shown (-1 when not navigating), and histbase the seq of the
+// line that was up when navigation began (-1 for the edit buffer).
+//
+// The lines themselves are packed NULL terminated into one arena of
+// hbytes, oldest to newest, wrapping around like the index:
+//
+//     harena: [ newer lines.. ][ free ][ oldest lines.. ][ unused ]
+//                             ^htail  ^hoff[histfirst]
+//
+// New lines go at htail; oldest lines are dropped to make room.
+// One allocation for all of history means no heap fragmentation.
+//
+// An entry removed from the middle (an older copy of a line entered
+// again, see histnodups) is left as a dead entry with hlen -1, which
+// up/down, search and saving skip, until it's dropped off the end.
+//
+
+// HASH 'len' BYTES OF 's' (FNV-1a)
+Local ulong hash_line(const char *s, int len)
+{
+    ulong h = 2166136261UL;
+    while ( len-- > 0 ) {
+        h ^= (uchar)*s++;
+        h  = (h * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
+}
+
+// RETURN INDEX SLOT OF HISTORY ENTRY 'seq'
+Local int hist_slot(Readline *rs, long seq)
+{
+    return (int)(seq % rs->histsize);
+}
+
+// RETURN HISTORY ENTRY 'seq'
+Local char* hist_line(Readline *rs, long seq)
+{
+    return rs->harena + rs->hoff[hist_slot(rs, seq)];
+}
+
+// SEE IF HISTORY ENTRY 'seq' IS DEAD (REMOVED)
+Local int hist_dead(Readline *rs, long seq)
+{
+    return rs->hlen[hist_slot(rs, seq)] < 0;
+}
+
+// PREFIX INDEX
+//    With rs->histprefix set, up/down only visit lines starting with
+//    what's before the cursor. To find those quickly, hsort[] is a
+//    treap of all history entries keyed by (line, seq), one node per
+//    history slot, so lines with a given prefix are one subtree range
+//    of it. Each node keeps the newest seq in its subtree that nav
+//    hasn't shown yet, so the next older match is found in O(log n):
+//    up hides the match it shows, down shows it again. hsort[] is
+//    built on first use, then push_history() and hist_drop() insert
+//    and delete in O(log n), with no shifting.
+//
+
+#define SORT_NIL  (-1)          // no node
+
+// TREAP PRIORITY OF ENTRY 'seq' (A HASH, SO SHAPE DOESN'T NEED rand())
+Local ulong sort_prio(long seq)
+{
+    ulong h = (ulong)seq * 2654435761UL;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dUL;
+    return h ^ (h >> 12);
+}
+
+// COMPARE NODE 't' TO LINE 's' OF 'seq', BY LINE THEN SEQ
+Local int sort_cmp(Readline *rs, int t, const char *s, long seq)
+{
+    long tseq = rs->hsort[t].seq;
+    int cmp = strcmp(hist_line(rs, tseq), s);
+    if ( cmp ) return cmp;
+    return (tseq < seq) ? -1 : (tseq > seq);
+}
+
+// NEWEST SEQ NOT HIDDEN IN SUBTREE 't' (-1 IF NONE)
+Local long sort_max(Readline *rs, int t)
+{
+    return ( t == SORT_NIL ) ? -1 : rs->hsort[t].max;
+}
+
+// RECOMPUTE NODE 't's NEWEST SEQ FROM ITS CHILDREN
+Local void sort_fix(Readline *rs, int t)
+{
+    RLSortNode *n = rs->hsort + t;
+    n->max = n->hidden ? -1 : n->seq;
+    n->max = MAX(n->max, sort_max(rs, n->left));
+    n->max = MAX(n->max, sort_max(rs, n->right));
+}
+
+// INSERT NODE 'n' INTO SUBTREE 't'
+// Returns:
+//    Subtree's new root
+//
+Local int sort_insert(Readline *rs, int t, int n)
+{
+    RLSortNode *a = rs->hsort;
+    int c;
+    if ( t == SORT_NIL ) return n;
+    if ( sort_cmp(rs, t, hist_line(rs, a[n].seq), a[n].seq) > 0 ) {
+        a[t].left = sort_insert(rs, a[t].left, n);
+        if ( sort_prio(a[a[t].left].seq) > sort_prio(a[t].seq) ) {
+            c = a[t].left;                      // rotate right
+            a[t].left = a[c].right;
+            a[c].right = t;
+            sort_fix(rs, t);
+            t = c;
+        }
+    } else {
+        a[t].right = sort_insert(rs, a[t].right, n);
+        if ( sort_prio(a[a[t].right].seq) > sort_prio(a[t].seq) ) {
+            c = a[t].right;                     // rotate left
+            a[t].right = a[c].left;
+            a[c].left = t;
+            sort_fix(rs, t);
+            t = c;
+        }
+    }
+    sort_fix(rs, t);
+    return t;
+}
+
+// JOIN SUBTREES 'l' AND 'r' (ALL OF 'l' BEFORE ALL OF 'r')
+Local int sort_join(Readline *rs, int l, int r)
+{
+    RLSortNode *a = rs->hsort;
+    if ( l == SORT_NIL ) return r;
+    if ( r == SORT_NIL ) return l;
+    if ( sort_prio(a[l].seq) > sort_prio(a[r].seq) ) {
+        a[l].right = sort_join(rs, a[l].right, r);
+        sort_fix(rs, l);
+        return l;
+    }
+    a[r].left = sort_join(rs, l, a[r].left);
+    sort_fix(rs, r);
+    return r;
+}
+
+// DELETE ENTRY 'seq' WITH LINE 's' FROM SUBTREE 't'
+// Returns:
+//    Subtree's new root
+//
+Local int sort_delete(Readline *rs, int t, const char *s, long seq)
+{
+    RLSortNode *a = rs->hsort;
+    int cmp;
+    if ( t == SORT_NIL ) return t;
+    if ( (cmp = sort_cmp(rs, t, s, seq)) == 0 )
+        return sort_join(rs, a[t].left, a[t].right);
+    if ( cmp > 0 ) a[t].left  = sort_delete(rs, a[t].left,  s, seq);
+    else           a[t].right = sort_delete(rs, a[t].right, s, seq);
+    sort_fix(rs, t);
+    return t;
+}
+
+// HIDE (on=1) OR SHOW (on=0) ENTRY 'seq' FROM PREFIX NAV
+//    Fixes the newest seqs on the path down to it.
+//
+Local void sort_hide(Readline *rs, int t, const char *s, long seq, int on)
+{
+    int cmp;
+    if ( t == SORT_NIL ) return;
+    if ( (cmp = sort_cmp(rs, t, s, seq)) == 0 ) rs->hsort[t].hidden = (char)on;
+    else if ( cmp > 0 ) sort_hide(rs, rs->hsort[t].left,  s, seq, on);
+    else                sort_hide(rs, rs->hsort[t].right, s, seq, on);
+    sort_fix(rs, t);
+}
+
+// NEWEST SEQ NOT HIDDEN IN SUBTREE 't' WHOSE LINE'S FIRST 'len'
+// CHARS ARE >= 'pfx' (past=0), OR <= 'pfx' (past=1)
+//
+Local long sort_side(Readline *rs, int t, const char *pfx, int len, int past)
+{
+    RLSortNode *a = rs->hsort;
+    long best = -1;
+    int cmp;
+    while ( t != SORT_NIL ) {
+        cmp = strncmp(hist_line(rs, a[t].seq), pfx, len);
+        if ( past ? (cmp > 0) : (cmp < 0) ) {   // node out: other side
+            t = past ? a[t].left : a[t].right;
+            continue;
+        }
+        if ( ! a[t].hidden ) best = MAX(best, a[t].seq);
+        best = MAX(best, sort_max(rs, past ? a[t].left : a[t].right));
+        t = past ? a[t].right : a[t].left;
+    }
+    return best;
+}
+
+// NEWEST SEQ NOT HIDDEN WHOSE LINE STARTS WITH 'pfx' ('len' CHARS)
+// Returns:
+//    Its seq, or -1 if none
+//
+Local long sort_newest(Readline *rs, const char *pfx, int len)
+{
+    RLSortNode *a = rs->hsort;
+    int t = rs->hsortroot, cmp;
+    while ( t != SORT_NIL &&
+            (cmp = strncmp(hist_line(rs, a[t].seq), pfx, len)) != 0 )
+        t = ( cmp < 0 ) ? a[t].right : a[t].left;
+    if ( t == SORT_NIL ) return -1;
+    return MAX(MAX(a[t].hidden ? -1 : a[t].seq,
+                   sort_side(rs, a[t].left,  pfx, len, 0)),
+               sort_side(rs, a[t].right, pfx, len, 1));
+}
+
+// ADD NEWEST HISTORY ENTRY 'seq' TO PREFIX INDEX
+Local void sort_add(Readline *rs, long seq)
+{
+    int n = hist_slot(rs, seq);
+    RLSortNode *a = rs->hsort + n;
+    a->seq    = seq;
+    a->left   = SORT_NIL;
+    a->right  = SORT_NIL;
+    a->hidden = 0;
+    a->max    = seq;
+    rs->hsortroot = sort_insert(rs, rs->hsortroot, n);
+}
+
+// REMOVE HISTORY ENTRY 'seq' FROM PREFIX INDEX
+Local void sort_del(Readline *rs, long seq)
+{
+    rs->hsortroot = sort_delete(rs, rs->hsortroot, hist_line(rs, seq), seq);
+}
+
+// BUILD PREFIX INDEX, IF NOT ALREADY
+Local void sort_build(Readline *rs)
+{
+    long seq;
+    if ( rs->hsort ) return;
+    rs->hsort     = (RLSortNode*)malloc(sizeof(RLSortNode) * rs->histsize);
+    rs->navmatch  = (long*)malloc(sizeof(long) * rs->histsize);
+    rs->navpfx    = (char*)malloc(rs->maxline);
+    rs->hsortroot = SORT_NIL;
+    rs->navidx    = 0;
+    for ( seq=rs->histfirst; seq<rs->histnext; seq++ )
+        if ( ! hist_dead(rs, seq) ) sort_add(rs, seq);
+}
+
+// SHOW AGAIN THE LINES PREFIX NAV HID, BACK TO 'n' OF THEM
+//    Ones dropped from history since are gone from the index already.
+//
+Local void prefix_unhide(Readline *rs, long n)
+{
+    long seq;
+    while ( rs->navidx > n ) {
+        seq = rs->navmatch[--rs->navidx];
+        if ( seq >= rs->histfirst && ! hist_dead(rs, seq) )
+            sort_hide(rs, rs->hsortroot, hist_line(rs, seq), seq, 0);
+    }
+}
+
+// START PREFIX NAV: FIND ENTRIES STARTING WITH TEXT BEFORE CURSOR
+//    Leaves navprefix 0 if up/down aren't to be filtered. Lines a
+//    last nav hid are shown again first.
+//
+Local void prefix_begin(Readline *rs)
+{
+    rs->navprefix = 0;
+    if ( ! rs->histprefix || rs->curpos == 0 ) return;
+    sort_build(rs);
+    prefix_unhide(rs, 0);
+    line_str(rs);
+    memcpy(rs->navpfx, rs->line, rs->curpos);   // (line changes as we nav)
+    rs->navprefix = rs->curpos;
+}
+
+// NEXT OLDER LINE STARTING WITH THE PREFIX, HIDING IT FROM THE NEXT
+// Returns:
+//    Its seq, or -1 if there's none
+//
+Local long prefix_up(Readline *rs)
+{
+    long seq = sort_newest(rs, rs->navpfx, rs->navprefix);
+    if ( seq < 0 ) return -1;
+    sort_hide(rs, rs->hsortroot, hist_line(rs, seq), seq, 1);
+    rs->navmatch[rs->navidx++] = seq;
+    return seq;
+}
+
+// DUPLICATE LINES
+//    With rs->histnodups set, entering a line already in history
+//    removes the older copy, so alternating between a few commands
+//    doesn't push everything else out. hdup[] is an open addressing
+//    hash table (linear probing) of the seqs of live entries, so
+//    finding a line's copy is O(1) expected rather than a scan of
+//    history. It's built on first use, and kept up to date by
+//    push_history() and hist_drop().
+//
+
+// RETURN hdup[] INDEX OF LINE 's' OF 'len' CHARS WITH HASH 'hash'
+//    If it's not in history, index of the empty entry it would go in.
+//
+Local long dup_find(Readline *rs, const char *s, int len, ulong hash)
+{
+    long i = (long)(hash & rs->hdupmask);
+    RLDup *d;
+    while ( (d = rs->hdup + i)->seq >= 0 ) {
+        if ( d->hash == hash && rs->hlen[hist_slot(rs, d->seq)] == len &&
+             memcmp(hist_line(rs, d->seq), s, len) == 0 ) break;
+        i = (i + 1) & rs->hdupmask;
+    }
+    return i;
+}
+
+// REMOVE ENTRY 'i' OF hdup[]
+//    Entries after it in its probe run shift back to fill the hole,
+//    so lookups never need to step over deleted entries.
+//
+Local void dup_del(Readline *rs, long i)
+{
+    long j = i, home;
+    while ( 1 ) {
+        j = (j + 1) & rs->hdupmask;
+        if ( rs->hdup[j].seq < 0 ) break;
+        home = (long)(rs->hdup[j].hash & rs->hdupmask);
+        // Can j's entry move back to i? Not if its home is in (i,j]
+        if ( (i <= j) ? (home <= i || home > j) : (home <= i && home > j) ) {
+            rs->hdup[i] = rs->hdup[j];
+            i = j;
+        }
+    }
+    rs->hdup[i].seq = -1;
+}
+
+// ADD NEWEST HISTORY ENTRY 'seq' TO DUPLICATES HASH
+//    If there's an older copy of its line, that's removed from history.
+//
+Local void dup_add(Readline *rs, long seq)
+{
+    int  len  = rs->hlen[hist_slot(rs, seq)];
+    ulong hash = hash_line(hist_line(rs, seq), len);
+    long i    = dup_find(rs, hist_line(rs, seq), len, hash);
+    long old  = rs->hdup[i].seq;
+    if ( old >= 0 ) {                           // kill older copy
+        if ( rs->hsort ) sort_del(rs, old);
+        rs->hused -= len + 1;
+        rs->hlen[hist_slot(rs, old)] = -1;
+    }
+    rs->hdup[i].seq  = seq;
+    rs->hdup[i].hash = hash;
+}
+
+// BUILD DUPLICATES HASH, IF NOT ALREADY
+//    Any duplicates already in history are removed.
+//
+Local void dup_build(Readline *rs)
+{
+    long seq, size = 1;
+    if ( rs->hdup ) return;
+    while ( size < 2L * rs->histsize ) size <<= 1;    // at most half full
+    rs->hdup     = (RLDup*)malloc(sizeof(RLDup) * size);
+    rs->hdupmask = size - 1;
+    for ( seq=0; seq<size; seq++ ) rs->hdup[seq].seq = -1;
+    for ( seq=rs->histfirst; seq<rs->histnext; seq++ )
+        if ( ! hist_dead(rs, seq) ) dup_add(rs, seq);
+}
+
+// DROP OLDEST HISTORY ENTRY
+Local void hist_drop(Readline *rs)
+{
+    long seq = rs->histfirst;
+    int  len = rs->hlen[hist_slot(rs, seq)];
+    long i;
+    if ( len >= 0 ) {                           // dead ones are gone already
+        if ( rs->hsort ) sort_del(rs, seq);
+        if ( rs->hdup ) {
+            i = dup_find(rs, hist_line(rs, seq), len,
+                         hash_line(hist_line(rs, seq), len));
+            if ( rs->hdup[i].seq == seq ) dup_del(rs, i);
+        }
+        rs->hused -= len + 1;
+    }
+    ++rs->histfirst;
+}
+
+// FIND ARENA ROOM FOR 'need' BYTES, DROPPING OLDEST ENTRIES AS NEEDED
+//    Returns arena offset of the room. Lines never wrap, so if the
+//    end of the arena is too short the line goes at the start.
+//
+Local long hist_room(Readline *rs, long need)
+{
+    long head;
+    while ( 1 ) {
+        if ( rs->histfirst == rs->histnext )    // empty? start over
+            { rs->htail = 0; return 0; }
+        head = rs->hoff[hist_slot(rs, rs->histfirst)];
+        if ( rs->htail > head ) {               // free: tail..end, 0..head
+            if ( rs->hbytes - rs->htail >= need ) return rs->htail;
+            if ( head >= need ) return 0;
+        } else {                                // free: tail..head
+            if ( head - rs->htail >= need ) return rs->htail;
+        }
+        hist_drop(rs);
+    }
+}
+
+// SHOW HISTORY ENTRY 'seq' AS THE CURRENT LINE (-1 FOR EDIT BUFFER)
+//    Points rs->line at the entry rather than copying it.
+//    Leaves cursor at eol.
+//
+Local void line_view(Readline *rs, long seq)
+{
+    int len;
+    if ( rs->line == rs->editbuf ) {            // leaving edit buffer?
+        line_str(rs);                           // ..close its gap
+        rs->editlen = rs->linelen;              // ..and remember length
+    }
+    if ( seq < 0 ) {
+        rs->line = rs->editbuf;
+        len = rs->editlen;
+    } else {
+        rs->line = hist_line(rs, seq);
+        len = rs->hlen[hist_slot(rs, seq)];
+    }
+    rs->lineseq  = seq;
+    rs->linelen  = len;
+    rs->linehigh = ( ascii_len(rs->line, len) < len );
+    rs->gapstart = len;                         // gap at end of line
+    rs->gapend   = rs->maxline;
+    rs->curpos   = len;
+    line_dirty(rs, 0);
+}
+
+// START HISTORY NAVIGATION, IF NOT ALREADY
+Local void history_nav(Readline *rs)
+{
+    if ( rs->histpos >= 0 ) return;
+    rs->histbase = rs->lineseq;                 // return here at bottom
+    rs->histpos  = rs->histnext;
+}
+
+// MOVE UP TO REVEAL NEXT HISTORY LINE
+// Returns:
+//    1 -- Successfully moved up one line
+//    0 -- Can't go higher
+//
+Local int history_up(Readline *rs)
+{
+    long pos;
+
+    if ( rs->histpos < 0 ) prefix_begin(rs);
+    if ( rs->navprefix ) {                      // next older match
+        if ( (pos = prefix_up(rs)) < 0 ) return 0;
+    } else {
+        pos = (rs->histpos < 0 ? rs->histnext : rs->histpos) - 1;
+        while ( pos >= rs->histfirst && hist_dead(rs, pos) ) --pos;
+    }
+
+    // Already at top? Do nothing
+    if ( pos < rs->histfirst ) return 0;
+
+    history_nav(rs);
+    rs->histpos = pos;
+    line_view(rs, pos);
+    if ( rs->navprefix ) rs->curpos = rs->navprefix;   // cursor stays after prefix
+    return 1;
+}
+
+// MOVE DOWN TO REVEAL PREVIOUS HISTORY LINE
+//    If we're back to first edit line, show it again;
+//    user may have visited history and returned.
+//
+Local void history_down(Readline *rs)
+{
+    // Already at bottom? Do nothing
+    if ( rs->histpos < 0 ) return;
+
+    // Move down; past the newest entry is the line we started on
+    if ( rs->navprefix ) {                      // show the one we hid
+        prefix_unhide(rs, rs->navidx - 1);
+        rs->histpos = rs->navidx ? rs->navmatch[rs->navidx - 1] : rs->histnext;
+    } else {
+        while ( ++rs->histpos < rs->histnext && hist_dead(rs, rs->histpos) ) { }
+    }
+    if ( rs->histpos == rs->histnext ) {
+        rs->histpos = -1;
+        line_view(rs, rs->histbase);
+    } else {
+        line_view(rs, rs->histpos);
+    }
+    if ( rs->navprefix ) rs->curpos = rs->navprefix;
+}
+
+// MOVE TO TOP OF HISTORY
+Local void history_top(Readline *rs)
+{
+    // Empty, or already at top? Do nothing
+    long pos = rs->histfirst;
+    if ( pos == rs->histnext ) return;
+    while ( hist_dead(rs, pos) ) ++pos;         // newest is never dead
+    if ( rs->histpos == pos ) return;
+
+    history_nav(rs);
+    rs->histpos   = pos;
+    rs->navprefix = 0;                          // up/down unfiltered from here
+    line_view(rs, rs->histpos);
+}
+
+// MOVE TO BOTTOM OF HISTORY (RETURN TO EDIT LINE)
 Local void history_bot(Readline *rs)
 {
-    // If already at bottom, early exit
-    if ( rs->histpos == 0 ) return;
+    // If already at bottom, early exit
+    if ( rs->histpos < 0 ) return;
+
+    rs->histpos = -1;
+    line_view(rs, rs->histbase);
+}
+
+////                ///////////////////////////////////////
+//// REVERSE SEARCH ///////////////////////////////////////
+////                ///////////////////////////////////////
+
+// ^R searches back through history for lines containing what's typed,
+// narrowing as each char is typed. To keep that fast with a big
+// history, lines are indexed by their trigrams (3 char substrings):
+// srchidx[] has a postings list per trigram hash bucket, of the seqs
+// of lines containing such a trigram, oldest first. A line matching
+// the pattern must be in the postings of every trigram of it, so only
+// lines in the shortest of those lists need to be strstr()ed.
+//
+// The index is built on first ^R, then kept up by push_history().
+// Postings of lines since dropped from history are skipped, and
+// trimmed off when a list needs to grow.
+//
+
+// RETURN INDEX BUCKET FOR TRIGRAM AT 's'
+Local int srch_bucket(const char *s)
+{
+    return (int)(hash_line(s, 3) & (SRCH_BUCKETS-1));
+}
+
+// RETURN INDEX OF FIRST POSTING WITH seq >= 'seq'
+Local int post_find(RLPost *p, long seq)
+{
+    int lo = 0, hi = p->len;
+    while ( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        if ( p->seq[mid] < seq ) lo = mid + 1;
+        else                     hi = mid;
+    }
+    return lo;
+}
+
+// ADD HISTORY ENTRY 'seq' TO SEARCH INDEX
+Local void srch_add(Readline *rs, long seq)
+{
+    const char *s = hist_line(rs, seq);
+    int i, n, len = rs->hlen[hist_slot(rs, seq)];
+    for ( i=0; i+3<=len; i++ ) {
+        RLPost *p = rs->srchidx + srch_bucket(s + i);
+        if ( p->len && p->seq[p->len-1] == seq ) continue;  // already in
+        if ( p->len == p->size ) {
+            // Full? Trim postings of lines dropped from history first
+            if ( (n = post_find(p, rs->histfirst)) > 0 ) {
+                memmove(p->seq, p->seq + n, sizeof(long) * (p->len - n));
+                p->len -= n;
+            }
+            if ( p->len == p->size ) {
+                p->size = p->size ? p->size * 2 : 8;
+                p->seq  = (long*)realloc(p->seq, sizeof(long) * p->size);
+            }
+        }
+        p->seq[p->len++] = seq;
+    }
+}
+
+// FIND NEWEST HISTORY LINE BEFORE 'before' CONTAINING SEARCH PATTERN
+// Returns:
+//    seq of line, or -1 if none
+//
+Local long srch_find(Readline *rs, long before)
+{
+    const char *pat = rs->srchpat;
+    RLPost *best = 0, *p;
+    long seq;
+    int i;
+
+    // Too short for a trigram? Matches are everywhere, just look
+    if ( rs->srchlen < 3 ) {
+        for ( seq=before-1; seq>=rs->histfirst; seq-- )
+            if ( ! hist_dead(rs, seq) && strstr(hist_line(rs, seq), pat) )
+                return seq;
+        return -1;
+    }
+
+    // Check lines in the shortest postings of pattern's trigrams
+    for ( i=0; i+3<=rs->srchlen; i++ ) {
+        p = rs->srchidx + srch_bucket(pat + i);
+        if ( best == 0 || p->len < best->len ) best = p;
+    }
+    for ( i=post_find(best, before)-1; i>=0; i-- ) {
+        seq = best->seq[i];
+        if ( seq < rs->histfirst ) break;       // dropped from history
+        if ( hist_dead(rs, seq) ) continue;     // removed dup
+        if ( strstr(hist_line(rs, seq), pat) ) return seq;
+    }
+    return -1;
+}
+
+// SHOW SEARCH MATCH 'match' AND UPDATE SEARCH PROMPT
+//    If there's no match (-1), the last match stays up.
+//
+Local void srch_show(Readline *rs, long match)
+{
+    if ( match >= 0 ) {
+        rs->srchmatch = match;
+        line_view(rs, match);
+        rs->curpos = strstr(rs->line, rs->srchpat) - rs->line;
+    }
+    sprintf(rs->srchprompt, "(%sreverse-i-search)`%s': ",
+            (match < 0 && rs->srchlen) ? "failed " : "", rs->srchpat);
+    rs->layprompt = 0;          // prompt's text changed; redo layout
+}
+
+// START ^R SEARCH
+//    Builds the search index the first time.
+//
+Local void search_begin(Readline *rs)
+{
+    long seq;
+    if ( rs->srchidx == 0 ) {
+        rs->srchidx    = (RLPost*)calloc(SRCH_BUCKETS, sizeof(RLPost));
+        rs->srchpat    = (char*)malloc(rs->maxline);
+        rs->srchprompt = (char*)malloc(rs->maxline + 32);
+        for ( seq=rs->histfirst; seq<rs->histnext; seq++ )
+            srch_add(rs, seq);
+    }
+    rs->searching  = 1;
+    rs->srchlen    = 0;
+    rs->srchpat[0] = 0;
+    rs->srchmatch  = -1;
+    rs->srchbase   = rs->lineseq;               // ^G returns here
+    rs->srchsave   = rs->prompt;
+    rs->prompt     = rs->srchprompt;
+    rs->histpos    = -1;
+    srch_show(rs, -1);
+}
+
+// END ^R SEARCH, LEAVING MATCH AS CURRENT LINE
+//    Up/down continue from the match, as if we'd navigated to it.
+//
+Local void search_end(Readline *rs)
+{
+    rs->searching = 0;
+    rs->prompt    = rs->srchsave;
+    if ( rs->srchmatch >= 0 && rs->lineseq == rs->srchmatch ) {
+        rs->histpos   = rs->srchmatch;
+        rs->histbase  = rs->srchbase;
+        rs->navprefix = 0;
+    }
+}
+
+// HANDLE KEY 'c' DURING ^R SEARCH
+// Returns:
+//    1 -- key handled
+//    0 -- search ended, handle key as usual
+//
+Local int search_key(Readline *rs, int c)
+{
+    switch ( c ) {
+        case 0x12:                              // ^R -- next older match
+            srch_show(rs, srch_find(rs, rs->srchmatch >= 0 ? rs->srchmatch
+                                                           : rs->histnext));
+            return 1;
+        case 0x08:                              // BACKSPACE -- unsearch char
+        case 0x7f:
+            if ( rs->srchlen > 0 ) rs->srchpat[--rs->srchlen] = 0;
+            rs->srchmatch = -1;
+            if ( rs->srchlen == 0 ) {           // nothing to look for
+                line_view(rs, rs->srchbase);
+                srch_show(rs, -1);
+            } else {
+                srch_show(rs, srch_find(rs, rs->histnext));
+            }
+            return 1;
+        case 0x1b:                              // ESC -- accept match
+            search_end(rs);
+            return 1;
+        case 0x07:                              // ^G -- abort search
+            rs->srchmatch = -1;
+            search_end(rs);
+            line_view(rs, rs->srchbase);
+            return 1;
+        default:
+            if ( (c == '\t' || (c >= ' ' && c < 0x100)) &&
+                 rs->srchlen < rs->maxline-1 ) {
+                // Narrow search; current match may still match
+                rs->srchpat[rs->srchlen++] = c;
+                rs->srchpat[rs->srchlen]   = 0;
+                srch_show(rs, srch_find(rs, rs->srchmatch >= 0 ? rs->srchmatch+1
+                                                               : rs->histnext));
+                return 1;
+            }
+            search_end(rs);                     // accept match
+            return 0;
+    }
+}
+
+// PUSH 'len' CHARS OF LINE 's' INTO HISTORY
+//    Drops the oldest entries if history is full.
+//
+Local void push_history(Readline *rs, const char *s, int len)
+{
+    int  slot = hist_slot(rs, rs->histnext);
+    long at;
+
+    len = MIN(len, rs->maxline-1);
+    if ( len+1 > rs->hbytes ) return;           // can never fit
+    STAT(rs, pushes, 1);
+    if ( rs->histnext - rs->histfirst == rs->histsize )
+        hist_drop(rs);                          // index full? drop oldest
+    at = hist_room(rs, len+1);
+    memcpy(rs->harena + at, s, len);
+    rs->harena[at+len] = 0;
+    rs->hoff[slot] = at;
+    rs->hlen[slot] = len;
+    rs->htail  = at + len + 1;
+    rs->hused += len + 1;
+    if ( rs->histnodups ) {
+        dup_build(rs);
+        dup_add(rs, rs->histnext);
+    } else if ( rs->hdup ) {                    // policy turned off?
+        free((void*)rs->hdup);                  // ..stop keeping hash
+        rs->hdup = 0;
+    }
+    if ( rs->hsort   ) sort_add(rs, rs->histnext);
+    if ( rs->srchidx ) srch_add(rs, rs->histnext);
+    ++rs->histnext;
+}
+
+// ADD A LINE TO THE HISTORY
+//    For the app to preload history, e.g. from a file.
+//
+Public void readline_history_add(Readline *rs, const char *s)
+{
+    push_history(rs, s, strlen(s));
+}
+
+// SET HISTORY ARENA'S BYTE BUDGET
+//    Keeps the newest lines that fit, repacked into the new arena.
+// Returns:
+//     0 -- OK
+//    -1 -- out of memory (history unchanged)
+//
+Public int readline_history_budget(Readline *rs, long bytes)
+{
+    char *arena;
+    long seq, first, at;
+
+#ifndef LINUX
+    bytes = MIN(bytes, HIST_MAXBYTES);
+#endif
+    if ( (arena = (char*)malloc((size_t)bytes)) == 0 ) return -1;
+
+    // Find oldest line that still fits, newest lines first
+    for ( at=0, first=rs->histnext; first>rs->histfirst; first-- ) {
+        long need = rs->hlen[hist_slot(rs, first-1)] + 1;    // dead: 0
+        if ( at + need > bytes ) break;
+        at += need;
+    }
+    while ( rs->histfirst < first )             // drop what didn't fit
+        hist_drop(rs);
+
+    // Repack them oldest first at start of new arena
+    for ( at=0, seq=first; seq<rs->histnext; seq++ ) {
+        int slot = hist_slot(rs, seq);
+        if ( rs->hlen[slot] >= 0 )
+            memcpy(arena + at, rs->harena + rs->hoff[slot], rs->hlen[slot] + 1);
+        rs->hoff[slot] = at;
+        at += rs->hlen[slot] + 1;
+    }
+    free((void*)rs->harena);
+    rs->harena    = arena;
+    rs->hbytes    = bytes;
+    rs->htail     = at;
+    rs->hused     = at;
+    return 0;
+}
+
+// RETURN BYTES OF MEMORY HISTORY TAKES
+//    If 'used' isn't NULL, it's set to bytes of arena holding lines.
+//
+Public long readline_history_mem(Readline *rs, long *used)
+{
+    if ( used ) *used = rs->hused;
+    return rs->hbytes + (long)rs->histsize * (sizeof(long) + sizeof(int));
+}
+
+// SHOW CONTENTS OF HISTORY BUFFER ON STDOUT
+//    Oldest first; 00 is the line last edited.
+//
+Public void show_history(Readline *rs)
+{
+    long seq;
+    for ( seq=rs->histfirst; seq<rs->histnext; seq++ )
+        if ( ! hist_dead(rs, seq) )
+            printf("%02ld) %s\033[K\n", rs->histnext - seq, hist_line(rs, seq));
+    printf("00) %s\033[K\n", rs->editbuf);
+}
+
+////              ///////////////////////////////////////
+//// HISTORY FILE ///////////////////////////////////////
+////              ///////////////////////////////////////
+
+// The history file is plain text, one line per entry, oldest first.
+// If rs->histfile is set, each line entered is appended to it, so the
+// file only grows at the end. Once it grows past histfilemax bytes
+// it's compacted: rewritten with just its newest histsize lines that
+// fit in hbytes, duplicates removed.
+//
+// Loading only needs the file's tail: on linux the file is mmap()ed
+// and scanned backwards for the last lines that fit the history,
+// so only those lines get copied, however big the file is.
+//
+
+// RETURN FILE SIZE THAT TRIGGERS COMPACTION
+Local long hist_filemax(Readline *rs)
+{
+    return rs->histfilemax ? rs->histfilemax : 2 * rs->hbytes;
+}
+
+// MAP FILE INTO MEMORY
+//    Sets *sizep to size of contents. On DOS there's no mmap(),
+//    so just the file's last HIST_MAXBYTES are read into a buffer,
+//    starting at a line boundary.
+// Returns:
+//    Pointer to contents, or NULL if empty (*sizep=0) or error (*sizep=-1)
+//
+Local char* map_file(const char *filename, long *sizep)
+{
+#ifdef LINUX
+    struct stat st;
+    char *p;
+    int fd = open(filename, O_RDONLY);
+    *sizep = -1;
+    if ( fd < 0 ) return 0;
+    if ( fstat(fd, &st) < 0 ) { close(fd); return 0; }
+    *sizep = (long)st.st_size;
+    if ( *sizep == 0 ) { close(fd); return 0; }
+    p = (char*)mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                          // mapping stays valid
+    if ( p == (char*)MAP_FAILED ) { *sizep = -1; return 0; }
+    return p;
+#else
+    FILE *fp = fopen(filename, "rb");
+    char *p, *nl;
+    long size, skip;
+    *sizep = -1;
+    if ( fp == 0 ) return 0;
+    fseek(fp, 0L, SEEK_END);
+    size = ftell(fp);
+    skip = MAX(0L, size - HIST_MAXBYTES);   // read just the tail
+    size -= skip;
+    if ( size == 0 || (p = (char*)malloc((size_t)size)) == 0 )
+        { fclose(fp); *sizep = size ? -1 : 0; return 0; }
+    fseek(fp, skip, SEEK_SET);
+    size = fread(p, 1, (size_t)size, fp);
+    fclose(fp);
+    if ( skip && (nl = (char*)memchr(p, '\n', (size_t)size)) != 0 ) {
+        size -= (nl + 1 - p);           // started mid-line? skip it
+        memmove(p, nl + 1, (size_t)size);
+    }
+    *sizep = size;
+    return p;
+#endif
+}
+
+// UNMAP FILE MAPPED BY map_file()
+Local void unmap_file(char *p, long size)
+{
+    if ( p == 0 ) return;
+#ifdef LINUX
+    munmap(p, (size_t)size);
+#else
+    free((void*)p);
+#endif
+}
 
-    // Cheat: force histpos to 1, and go down
-    //     This reuses logic to handle restoring edit line
-    //
-    rs->histpos = 1;
-    history_down(rs);
+// FIND LINE ENDING AT buf[end] (EXCLUSIVE), SCANNING BACKWARDS
+//    Returns offset of line's first char; the '\n' before it, if any,
+//    is at the returned offset-1.
+//
+Local long line_back(const char *buf, long end)
+{
+    while ( end > 0 && buf[end-1] != '\n' ) --end;
+    return end;
 }
 
-// PUSH CURRENT COMMAND INTO HISTORY
-//     BEFORE: a,b,c,d,e
-//      AFTER: a,a,b,c,d
-//             ^ current cmd, e.g. history[0]
+// LENGTH OF LINE buf[from..end) WITHOUT TRAILING '\r' (DOS FILES)
+Local int line_trim(const char *buf, long from, long end)
+{
+    if ( end > from && buf[end-1] == '\r' ) --end;
+    return (int)(end - from);
+}
+
+// OPEN FILE TO REWRITE HISTORY FILE
+//    On linux we write to 'filename.tmp' and rename() over the
+//    original when done, so a crash can't leave half a file.
 //
-Local void push_history(Readline *rs)
+Local FILE* hist_create(const char *filename, char **tmpp)
 {
-    int t;
-    int top    = rs->histsize-1;
-    char *htop = rs->history[top];  // save top; we overwrite it w/scroll
+#ifdef LINUX
+    FILE *fp;
+    *tmpp = (char*)malloc(strlen(filename) + 5);
+    sprintf(*tmpp, "%s.tmp", filename);
+    if ( (fp = fopen(*tmpp, "w")) == 0 ) { free((void*)*tmpp); *tmpp = 0; }
+    return fp;
+#else
+    *tmpp = 0;                          // 8.3 filenames; write in place
+    return fopen(filename, "w");
+#endif
+}
 
-    // FIRST SCROLL HISTORY UP
-    //    Just move the pointers around. Could have been a linked list,
-    //    but working with an array is just plain easier to write and debug.
-    //    This overwrites top, and leaves [0] and [1] dupes.
-    //
-    for ( t=top; t>0; t-- )
-        { rs->history[t] = rs->history[t-1]; }
+// FINISH REWRITING HISTORY FILE
+// Returns:
+//     0 -- OK
+//    -1 -- write failed (original file left as it was)
+//
+Local int hist_commit(FILE *fp, const char *filename, char *tmp)
+{
+    int err = ferror(fp);
+    err |= fclose(fp);
+    if ( tmp ) {
+        if ( err == 0 ) err = rename(tmp, filename);
+        if ( err != 0 ) remove(tmp);
+        free((void*)tmp);
+    }
+    return err ? -1 : 0;
+}
 
-    // MOVE 'TOP' DOWN TO history[0]
-    //    We don't care about top's string contents, but
-    //    we don't want to lose top's memory allocation.
-    //
-    rs->history[0] = htop;
+// COMPACT HISTORY FILE WHOSE CONTENTS ARE buf[0..size)
+//    Rewrites it with its newest histsize unique lines, oldest first,
+//    no more of them than fit in hbytes (or half of histfilemax), so
+//    the file has room to grow before it's compacted again.
+//    Only the newest copy of a duplicated line is kept.
+// Returns:
+//     0 -- OK
+//    -1 -- error
+//
+Local int hist_compact(Readline *rs, const char *filename,
+                       const char *buf, long size)
+{
+    long *off, *tab, end, from, kept = 0;
+    long keepmax = MIN(rs->hbytes, hist_filemax(rs) / 2);
+    int  *len, n = 0, hsize, t;
+    char *tmp;
+    FILE *fp;
+
+    // Hash table of lines kept so far, to spot duplicates
+    for ( hsize=1; hsize < rs->histsize*2; hsize <<= 1 ) { }
+    off = (long*)malloc(sizeof(long) * rs->histsize);
+    len = (int*)malloc(sizeof(int) * rs->histsize);
+    tab = (long*)malloc(sizeof(long) * hsize);
+    if ( !off || !len || !tab ) { n = -1; goto done; }
+    for ( t=0; t<hsize; t++ ) tab[t] = -1;
+
+    // Walk lines newest to oldest, keeping the first copy of each
+    for ( end=size; end > 0 && n < rs->histsize; end = from - 1 ) {
+        int l, h;
+        if ( buf[end-1] == '\n' ) --end;    // drop newline
+        from = line_back(buf, end);
+        if ( (l = line_trim(buf, from, end)) == 0 ) {
+            if ( from == 0 ) break;
+            continue;
+        }
+        h = (int)(hash_line(buf + from, l) & (hsize-1));
+        for ( ; tab[h] >= 0; h = (h+1) & (hsize-1) )
+            if ( len[tab[h]] == l && memcmp(buf + off[tab[h]], buf + from, l) == 0 )
+                break;
+        if ( tab[h] < 0 ) {                 // not a dup? keep it
+            if ( (kept += l + 1) > keepmax ) break;
+            tab[h] = n; off[n] = from; len[n] = l; n++;
+        }
+        if ( from == 0 ) break;
+    }
 
-    // COPY EDIT LINE SCROLLED INTO history[1] back to history[0]
-    strcpy(rs->history[0], rs->history[1]);
+    // Write them back out oldest first
+    if ( (fp = hist_create(filename, &tmp)) == 0 ) { n = -1; goto done; }
+    for ( t=n-1; t>=0; t-- ) {
+        fwrite(buf + off[t], 1, len[t], fp);
+        fputc('\n', fp);
+    }
+    if ( hist_commit(fp, filename, tmp) < 0 ) n = -1;
+    if ( n >= 0 && rs->histfile && strcmp(filename, rs->histfile) == 0 ) {
+        rs->histfilesize = 0;
+        for ( t=0; t<n; t++ ) rs->histfilesize += len[t] + 1;
+    }
+done:
+    free((void*)off);
+    free((void*)len);
+    free((void*)tab);
+    return n < 0 ? -1 : 0;
 }
 
-// SHOW CONTENTS OF HISTORY BUFFER ON STDOUT
-Public void show_history(Readline *rs)
+// APPEND LINE TO rs->histfile
+//    Compacts the file if this makes it too big.
+//
+Local void hist_append(Readline *rs, const char *s, int len)
+{
+    FILE *fp = fopen(rs->histfile, "a");
+    if ( fp == 0 ) return;
+    fwrite(s, 1, len, fp);
+    fputc('\n', fp);
+    fclose(fp);
+    rs->histfilesize += len + 1;
+    if ( rs->histfilesize > hist_filemax(rs) ) {
+        long size;
+        char *buf = map_file(rs->histfile, &size);
+        if ( buf ) hist_compact(rs, rs->histfile, buf, size);
+        unmap_file(buf, size);
+    }
+}
+
+// LOAD HISTORY FROM A FILE
+//    Only the newest lines that fit in the history are loaded,
+//    found by scanning back from the end of the file.
+//    Compacts the file if it's grown past histfilemax.
+// Returns:
+//     0 -- OK (empty file is OK)
+//    -1 -- can't open/read file
+//
+Public int readline_history_load(Readline *rs, const char *filename)
+{
+    long size, start, end, bytes = 0, from;
+    int  n = 0;
+    char *buf = map_file(filename, &size);
+
+    if ( size <= 0 ) return (int)size;          // empty (0) or error (-1)
+
+    // Find start of the newest lines that fit
+    for ( start=end=size; end > 0 && n < rs->histsize; end = start - 1 ) {
+        if ( buf[end-1] == '\n' ) --end;
+        from = line_back(buf, end);
+        bytes += MIN(end - from, rs->maxline-1) + 1;
+        if ( bytes > rs->hbytes ) break;
+        start = from;
+        n++;
+        if ( from == 0 ) break;
+    }
+
+    // Push them oldest first
+    for ( from=start; from < size; from = end + 1 ) {
+        int l;
+        char *nl = (char*)memchr(buf + from, '\n', (size_t)(size - from));
+        end = nl ? (nl - buf) : size;
+        if ( (l = line_trim(buf, from, end)) > 0 )
+            push_history(rs, buf + from, l);
+    }
+
+    if ( rs->histfile && strcmp(filename, rs->histfile) == 0 ) {
+        rs->histfilesize = size;
+        if ( size > hist_filemax(rs) ) hist_compact(rs, filename, buf, size);
+    }
+    unmap_file(buf, size);
+    return 0;
+}
+
+// SAVE HISTORY TO A FILE
+//    Writes all of history, oldest first, replacing the file.
+// Returns:
+//     0 -- OK
+//    -1 -- can't write file
+//
+Public int readline_history_save(Readline *rs, const char *filename)
 {
-    int t, top = rs->histsize-1;
-    for ( t=top; t>=0; t-- ) {
-        printf("%02d) %s\033[K\n", t, rs->history[t]);
+    long seq;
+    char *tmp;
+    FILE *fp = hist_create(filename, &tmp);
+    if ( fp == 0 ) return -1;
+    for ( seq=rs->histfirst; seq<rs->histnext; seq++ ) {
+        if ( hist_dead(rs, seq) ) continue;
+        fwrite(hist_line(rs, seq), 1, rs->hlen[hist_slot(rs, seq)], fp);
+        fputc('\n', fp);
     }
+    if ( hist_commit(fp, filename, tmp) < 0 ) return -1;
+    if ( rs->histfile && strcmp(filename, rs->histfile) == 0 )
+        rs->histfilesize = rs->hused;           // one '\n' per NULL
+    return 0;
 }
 
 // SEE IF LINE IS EMPTY (ALL BLANKS)
 Local int is_empty(const char *s)
 {
-    // Stop at eol or first non-white char
-    while ( *s && (*s==' ' || *s=='\t') ) s++;
-    return *s ? 0 : 1;
+    int n = strlen(s);
+    return scan_fwd(s, n, ' ', 0x09, 0) == n;  // no non-white char?
 }
 
 // USER HIT ENTER
@@ -570,32 +3702,193 @@ Local int is_empty(const char *s)
 //
 Local void enter_key(Readline *rs)
 {
-    const char *last = rs->history[1];
-    const char *line = rs->history[0];
+    const char *line;
+    int x, y;
+
+    // Showing a history entry? Copy it to edit buffer, it's returned
+    line_edit(rs);
+    line = line_str(rs);
 
-    // Reset histpos to zero
-    rs->histpos = 0;
+    // Done navigating
+    rs->histpos = -1;
 
     // Save copy of line to history
     //    Only if non-blanks and not same as last line
     //
-    if ( !is_empty(line) && strcmp(last, line)!=0)
-        push_history(rs);
+    if ( !is_empty(line) &&
+         ( rs->histnext == rs->histfirst ||
+           strcmp(hist_line(rs, rs->histnext-1), line) != 0 ) ) {
+        push_history(rs, line, rs->linelen);
+        if ( rs->histfile ) hist_append(rs, line, rs->linelen);
+    }
 
     // Leave cursor on next line after eol
     cursor_eol(rs);
+    rs->listing = 0;                            // (completions go away)
     redraw_line(rs);
-    printf("\n");
+    x = rs->cursorx;                            // (cursor's at eol)
+    y = rs->cursory;
+    if ( y+1 < rs->scrn_h ) ++y;
+    else                    scroll_up(rs, 1);
+    rs->term->move(rs, x, y);
+    rs->term->end(rs);
+    rs->term->flush(rs);
+}
+
+// UNDO LAST STEP OF EDITS
+//    If a history entry's being shown, first goes back to the edit buffer.
+//
+Local void undo(Readline *rs)
+{
+    RLUndo *u = 0;
+    long step;
+    if ( rs->line != rs->editbuf ) {
+        rs->histpos = -1;
+        line_view(rs, -1);
+        return;
+    }
+    if ( rs->utop == 0 ) return;
+    step = rs->ulog[rs->utop-1].step;
+    while ( rs->utop > 0 && rs->ulog[rs->utop-1].step == step ) {
+        u = rs->ulog + --rs->utop;
+        undo_apply(rs, u->pos, u->ins, rs->ubuf + u->off, u->del);
+    }
+    rs->curpos = MIN(u->cur, rs->linelen);      // cursor as before the step
+}
+
+// REDO LAST STEP UNDONE
+Local void redo(Readline *rs)
+{
+    RLUndo *u;
+    long step;
+    if ( rs->line != rs->editbuf || rs->utop == rs->ulogn ) return;
+    step = rs->ulog[rs->utop].step;
+    while ( rs->utop < rs->ulogn && rs->ulog[rs->utop].step == step ) {
+        u = rs->ulog + rs->utop++;
+        undo_apply(rs, u->pos, u->del, rs->ubuf + u->off + u->del, u->ins);
+        rs->curpos = u->pos + u->ins;
+    }
+}
+
+// UNDO WHAT THE LAST KEY DID, IF ANYTHING
+//    For keys that put back what they removed when hit again (^U, ^K).
+//
+Local void undo_last_key(Readline *rs)
+{
+    if ( rs->utop > 0 && rs->ulog[rs->utop-1].step == rs->ustep - 1 )
+        undo(rs);
+}
+
+// 80 //////////////////////////////////////////////////////////////////////////
+
+////           //////////////////////////////////////////
+//// KILL RING //////////////////////////////////////////
+////           //////////////////////////////////////////
+
+// Text killed (^W, Alt-D, ^K, ^U) is kept in killbuf, newest last, so
+// ^Y can yank it back, and Alt-Y swap that for older kills. Kills by
+// keys in a row join into one. When killbuf or the ring is full, the
+// oldest kills go.
+//
+
+// DROP OLDEST KILL
+Local void kill_drop(Readline *rs)
+{
+    int i, len = rs->killlen[0];
+    memmove(rs->killbuf, rs->killbuf + len, (size_t)(rs->killused - len));
+    for ( i=1; i<rs->killn; i++ ) {
+        rs->killoff[i-1] = rs->killoff[i] - len;
+        rs->killlen[i-1] = rs->killlen[i];
+    }
+    rs->killused -= len;
+    --rs->killn;
+}
+
+// SAVE 'n' CHARS 's' IN KILL RING
+//    If the last key killed too, joins its kill: before it if 'back'
+//    (killing leftward), else after it.
+//
+Local void kill_save(Readline *rs, const char *s, int n, int back)
+{
+    int  join = rs->killkey && rs->killn > 0;
+    long *off;
+    int  *len;
+    while ( rs->killn > join &&
+            ( rs->killused + n > rs->killsize || ( ! join && rs->killn == RL_KILL_RING ) ) )
+        kill_drop(rs);
+    if ( rs->killused + n > rs->killsize ) {    // too big: keep what's nearest
+        if ( back ) s += n - (rs->killsize - rs->killused);
+        n = (int)(rs->killsize - rs->killused);
+    }
+    if ( ! join ) {
+        rs->killoff[rs->killn] = rs->killused;
+        rs->killlen[rs->killn] = 0;
+        ++rs->killn;
+    }
+    off = rs->killoff + rs->killn - 1;
+    len = rs->killlen + rs->killn - 1;
+    if ( back ) {
+        memmove(rs->killbuf + *off + n, rs->killbuf + *off, *len);
+        memcpy(rs->killbuf + *off, s, n);
+    } else {
+        memcpy(rs->killbuf + *off + *len, s, n);
+    }
+    *len += n;
+    rs->killused += n;
+}
+
+// KILL CHARS 'from' UP TO 'to': SAVE IN KILL RING, DELETE FROM LINE
+//    'back' says which way it's killing (see kill_save()).
+//
+Local void kill_range(Readline *rs, int from, int to, int back)
+{
+    if ( to <= from ) return;
+    move_gap(rs, from);                         // range is after gap
+    kill_save(rs, rs->line + rs->gapend, to - from, back);
+    delete_range(rs, from, to);
+}
+
+// YANK LAST KILL BACK AT CURSOR
+// Returns:
+//    1 -- yanked
+//    0 -- nothing killed yet
+//
+Local int yank(Readline *rs)
+{
+    int k = rs->killn - 1;
+    if ( k < 0 ) return 0;
+    rs->killyank = k;
+    rs->yankpos  = rs->curpos;
+    rs->yanklen  = insert_text(rs, rs->killbuf + rs->killoff[k], rs->killlen[k]);
+    return 1;
+}
+
+// SWAP TEXT JUST YANKED FOR THE KILL BEFORE IT
+//    Only right after ^Y (or Alt-Y); the oldest kill wraps to the newest.
+// Returns:
+//    1 -- swapped
+//    0 -- last key didn't yank
+//
+Local int yank_pop(Readline *rs)
+{
+    int k;
+    if ( ! rs->yankkey || rs->killn == 0 ) return 0;
+    delete_range(rs, rs->yankpos, rs->yankpos + rs->yanklen);
+    k = ( rs->killyank > 0 ) ? rs->killyank - 1 : rs->killn - 1;
+    rs->killyank = k;
+    rs->yanklen  = insert_text(rs, rs->killbuf + rs->killoff[k], rs->killlen[k]);
+    return 1;
 }
 
-Local void line_cancel(Readline *rs)
+// CANCEL LINE: KILL FROM SOL TO 'end'
+//    If hit again, puts it back.
+//
+Local void line_cancel(Readline *rs, int end)
 {
     if ( rs->lcanmode == 0 ) {
-        undo_save(rs);
-        rs->history[0][0] = 0;      // truncate line
-        rs->curpos        = 0;      // cursor to sol
+        kill_range(rs, 0, end, 1);
     } else {
-        undo_restore(rs);
+        undo_last_key(rs);          // hit again: put it back
     }
     rs->lcanmode ^= 1;  // toggle between save/restore modes
     rs->lcankey   = 1;  // line cancel key was hit
@@ -603,180 +3896,641 @@ Local void line_cancel(Readline *rs)
 
 // 80 //////////////////////////////////////////////////////////////////////////
 
-// HANDLE ESC CHAR
-//    On linux, this is the start of a multi-character terminal key code.
-//    in DOS this is just the escape key, which is line cancel.
+////            /////////////////////////////////////////
+//// COMPLETION /////////////////////////////////////////
+////            /////////////////////////////////////////
+
+// TAB completes the word before the cursor, from the app's rs->complete()
+// if it set one, else from the candidate store: words the app loads with
+// readline_complete_add(), kept sorted so the words starting with a
+// prefix are a run found by binary search, and their longest common
+// prefix is just that of the run's first and last words.
+//
+
+// ADD 'n' CANDIDATE WORDS TO THE COMPLETION STORE
+//    Words are copied; load them all up front, they're sorted on first use.
+// Returns:
+//     0 -- OK
+//    -1 -- out of memory (words up to that point were added)
 //
-Local int handle_esc(Readline *rs)
+Public int readline_complete_add(Readline *rs, const char **words, long n)
 {
-#ifdef LINUX
+    long i, len, size;
+    void *p;
+    for ( i=0; i<n; i++ ) {
+        len = strlen(words[i]) + 1;
+        if ( rs->cbytes + len > rs->csize ) {           // grow arena
+            size = MAX(rs->csize * 2, rs->cbytes + len + 4096);
+            if ( (p = realloc(rs->carena, (size_t)size)) == 0 ) return -1;
+            rs->carena = (char*)p;
+            rs->csize  = size;
+        }
+        if ( rs->cwords == rs->cwordsize ) {            // grow index
+            size = MAX(rs->cwordsize * 2, 1024);
+            if ( (p = realloc(rs->cword, sizeof(long) * size)) == 0 ) return -1;
+            rs->cword     = (long*)p;
+            rs->cwordsize = size;
+        }
+        memcpy(rs->carena + rs->cbytes, words[i], (size_t)len);
+        rs->cword[rs->cwords++] = rs->cbytes;
+        rs->cbytes += len;
+        rs->csorted = 0;
+    }
+    return 0;
+}
+
+// EMPTY THE COMPLETION STORE
+Public void readline_complete_clear(Readline *rs)
+{
+    free((void*)rs->carena);
+    free((void*)rs->cword);
+    rs->carena    = 0;
+    rs->cword     = 0;
+    rs->cbytes    = rs->csize = 0;
+    rs->cwords    = rs->cwordsize = 0;
+    rs->csorted   = 1;
+}
 
-  char c = getch();
-  if ( c!= '[' ) return c;
-  c = getch();
-  switch (c) {
-    case 'A': history_up(rs);   rs->hnav=1; return 256; // UP ARROW  ESC[A
-    case 'B': history_down(rs); rs->hnav=1; return 256; // DN ARROW  ESC[B
-    case 'C': cursor_right(rs);             return 256; // RT ARROW  ESC[C
-    case 'D': cursor_left(rs);              return 256; // LT ARROW  ESC[D
-    case 'H': cursor_sol(rs);               return 256; // HOME      ESC[H
-    case 'F': cursor_eol(rs);               return 256; // END       ESC[F
-    case '5':                      getch(); return 256; // PG UP     ESC[5~
-    case '6':                      getch(); return 256; // PG DN     ESC[6~
-    case '3': delete_char(rs);     getch(); return 256; // DEL       ESC[3~
-    case '1':
-      if ( (c = getch()) != ';' ) return c;
-      if ( (c = getch()) != '5' ) return c;
-      c = getch();
-      switch (c) {
-	case 'A': history_top(rs); rs->hnav=1; return 256; // CTRL-UP  ESC[1;5A
-	case 'B': history_bot(rs); rs->hnav=1; return 256; // CTRL-DN  ESC[1;5B
-	case 'C': word_right(rs);              return 256; // CTRL-RT  ESC[1;5C
-	case 'D': word_left(rs,0);             return 256; // CTRL-LT  ESC[1;5D
-	default: return c;
-      }
-      break;
-  }
-  return c;
+// qsort() compare of candidate offsets
+static Readline *comp_rs;       // store being sorted
+Local int comp_cmp(const void *a, const void *b)
+{
+    return strcmp(comp_rs->carena + *(const long*)a,
+                  comp_rs->carena + *(const long*)b);
+}
 
-#else
+// SORT CANDIDATE STORE, DROPPING DUPLICATES, IF NOT ALREADY
+Local void comp_sort(Readline *rs)
+{
+    long i, n;
+    if ( rs->csorted ) return;
+    comp_rs = rs;
+    qsort(rs->cword, (size_t)rs->cwords, sizeof(long), comp_cmp);
+    for ( i=1, n=MIN(rs->cwords, 1); i<rs->cwords; i++ )
+        if ( strcmp(rs->carena + rs->cword[i], rs->carena + rs->cword[n-1]) )
+            rs->cword[n++] = rs->cword[i];
+    rs->cwords  = n;
+    rs->csorted = 1;
+}
+
+// FIND STORE'S RUN OF WORDS STARTING WITH compword: complo, compn
+Local void comp_find(Readline *rs)
+{
+    long lo = 0, hi = rs->cwords, mid, first;
+    const char *w = rs->compword;
+    int len = rs->compwordlen;
+    comp_sort(rs);
+    while ( lo < hi ) {                 // first word >= prefix
+        mid = (lo + hi) / 2;
+        if ( strncmp(rs->carena + rs->cword[mid], w, len) < 0 ) lo = mid + 1;
+        else                                                    hi = mid;
+    }
+    first = lo;
+    hi = rs->cwords;
+    while ( lo < hi ) {                 // first word past prefix
+        mid = (lo + hi) / 2;
+        if ( strncmp(rs->carena + rs->cword[mid], w, len) <= 0 ) lo = mid + 1;
+        else                                                     hi = mid;
+    }
+    rs->complo = first;
+    rs->compn  = lo - first;
+}
+
+// LENGTH OF LONGEST COMMON PREFIX OF 'a' AND 'b', UP TO 'max'
+Local int prefix_len(const char *a, const char *b, int max)
+{
+    int n = 0;
+    while ( n < max && a[n] && a[n] == b[n] ) n++;
+    return n;
+}
+
+// TAB: COMPLETE WORD BEFORE CURSOR
+//    Adds what all the candidates have in common (and a space if there's
+//    just one). If that adds nothing, a 2nd TAB lists them below the
+//    line, and more TABs page through the list.
+//
+Local void complete_key(Readline *rs)
+{
+    const char *first, *s;
+    int start, lcp;
+    long i;
+
+    if ( rs->listing ) {                        // listing? next page
+        rs->listpos += rs->listn;
+        if ( rs->listpos >= rs->compn ) rs->listing = 0;
+        return;
+    }
+
+    // Word before cursor
+    line_str(rs);
+    for ( start = rs->curpos; start > 0 && rs->line[start-1] != ' ' &&
+                              rs->line[start-1] != '\t'; start-- ) { }
+    rs->compwordlen = rs->curpos - start;
+    memcpy(rs->compword, rs->line + start, rs->compwordlen);
+    rs->compword[rs->compwordlen] = 0;
+
+    // Its candidates, and what they have in common
+    if ( rs->complete ) {
+        if ( (first = comp_get(rs, 0)) == 0 ) return;
+        lcp = strlen(first);
+        for ( i=1; (s = comp_get(rs, i)) != 0; i++ )
+            lcp = prefix_len(first, s, lcp);
+        rs->compn = i;
+    } else {
+        comp_find(rs);
+        if ( rs->compn == 0 ) return;
+        first = rs->carena + rs->cword[rs->complo];
+        s     = rs->carena + rs->cword[rs->complo + rs->compn - 1];
+        lcp   = prefix_len(first, s, strlen(first));
+    }
+
+    if ( lcp > rs->compwordlen || rs->compn == 1 ) {
+        insert_str(rs, first + rs->compwordlen, lcp - rs->compwordlen);
+        if ( rs->compn == 1 ) append_char(rs, ' ');
+        rs->comptab = ( rs->compn > 1 );        // next TAB lists them
+    } else if ( rs->comptab ) {                 // TAB again: list them
+        rs->listing = 1;
+        rs->listpos = 0;
+    } else {
+        rs->comptab = 1;
+    }
+}
+
+// 80 //////////////////////////////////////////////////////////////////////////
+
+////             ////////////////////////////////////////
+//// KEY DECODER ////////////////////////////////////////
+////             ////////////////////////////////////////
+
+// Multi-code keys (terminal ESC sequences on linux, 0x00 + scan code
+// in DOS) are looked up in a trie of the byte sequences bound to keys:
+// keytrie[0] is the root, and each node's children are the nodes for
+// the bytes that can follow it, so decoding a key is one step down
+// the trie per byte. The trie starts out with default_keys[] (top of
+// file), and the app can add to it or change it with readline_bind().
+//
+// Bytes can arrive a few at a time (e.g. readline_feed()), so they're
+// kept in keybuf until they make a whole key. ESC is both a key and
+// the start of others; it's only taken as the ESC key if nothing else
+// comes within esctimeout msecs.
+//
+
+// RETURN CHILD OF TRIE NODE 'node' FOR BYTE 'c' (0 IF NONE)
+Local int key_child(Readline *rs, int node, char c)
+{
+    for ( node = rs->keytrie[node].child; node; node = rs->keytrie[node].next )
+        if ( rs->keytrie[node].c == c ) break;
+    return node;
+}
+
+// BIND 'len' BYTE SEQUENCE 'seq' TO 'key'
+//    If 'len' is -1, seq is NULL terminated.
+//    A 'key' of -1 unbinds the sequence (its bytes are then dropped).
+// Returns:
+//     0 -- OK
+//    -1 -- out of memory, or bad sequence
+//
+Public int readline_bind(Readline *rs, const char *seq, int len, int key)
+{
+    int node = 0, child, i;
+    RLKeyNode *t;
+
+    if ( len < 0 ) len = strlen(seq);
+    if ( len < 1 || len > (int)sizeof(rs->keybuf) ) return -1;
+    for ( i=0; i<len; i++ ) {
+        if ( (child = key_child(rs, node, seq[i])) == 0 ) {
+            if ( rs->keynodes == rs->keytriesize ) {        // full? grow
+                t = (RLKeyNode*)realloc(rs->keytrie,
+                                        sizeof(RLKeyNode) * rs->keytriesize * 2);
+                if ( t == 0 ) return -1;
+                rs->keytrie      = t;
+                rs->keytriesize *= 2;
+            }
+            child = rs->keynodes++;
+            rs->keytrie[child].c     = seq[i];
+            rs->keytrie[child].key   = -1;
+            rs->keytrie[child].child = 0;
+            rs->keytrie[child].next  = rs->keytrie[node].child;
+            rs->keytrie[node].child  = child;
+        }
+        node = child;
+    }
+    rs->keytrie[node].key = key;
+    return 0;
+}
 
-  // DOS: ESC cancels line
-  line_cancel(rs);
+// DECODE KEY AT START OF rs->keybuf
+//    If 'timedout', no more bytes are coming for now, so take what's
+//    there as is (e.g. a lone ESC is the ESC key).
+//
+//    Bytes that aren't a bound key are dropped: a whole unknown ESC[
+//    sequence up to its final byte, ESC O and its byte, or ESC and the
+//    char after it (e.g. an unbound Alt key). Other bytes are keys as is.
+//
+// Returns:
+//    Number of bytes of keybuf used, with the key in *key (-1 if none),
+//    or 0 if more bytes are needed.
+//
+Local int key_decode(Readline *rs, int *key, int timedout)
+{
+    uchar *k    = (uchar*)rs->keybuf;
+    int    n    = rs->keylen;
+    int    full = timedout || n == (int)sizeof(rs->keybuf);
+    int    node = 0, i;
+
+    *key = -1;
+
+    // Walk down the trie; a leaf is a whole key
+    for ( i=0; i<n; i++ ) {
+        if ( (node = key_child(rs, node, k[i])) == 0 ) break;
+        if ( rs->keytrie[node].child == 0 ) {
+            *key = rs->keytrie[node].key;
+            return i+1;
+        }
+    }
+    if ( i == n ) {                             // start of some longer key
+        if ( ! full ) return 0;                 // ..wait for rest of it
+        if ( rs->keytrie[node].key >= 0 ) {     // ..or take it as is
+            *key = rs->keytrie[node].key;
+            return n;
+        }
+    }
 
+    // Not a bound key
+    if ( k[0] == 0x1b && n > 1 ) {
+        switch ( k[1] ) {
+            case '[':                           // CSI: up to final byte
+                for ( i=2; i<n; i++ )
+                    if ( k[i] >= 0x40 && k[i] <= 0x7e ) return i+1;
+                return full ? n : 0;
+            case 'O':                           // SS3: one more byte
+                if ( n >= 3 ) return 3;
+                return full ? n : 0;
+            case 0x1b:                          // ESC ESC: first is a key
+                *key = 0x1b;
+                return 1;
+        }
+        return 2;                               // ESC + char
+    }
+#ifndef LINUX
+    if ( k[0] == 0x00 ) return MIN(n, 2);       // unbound scan code
 #endif
+    *key = k[0];
+    return 1;
 }
 
-// Read a line from the user
-//     Handles line editing, command history.
+// HANDLE ONE KEY
+//    'key' is a char, or one of the RL_KEY_xxx codes for multi-code keys.
+//    Sets rs->lineready if it finished the line.
 //
-Public char* readline(Readline *rs)
+Local void do_key(Readline *rs, int key)
 {
-    int save_py = rs->prompty;   // save; we may adjust during scrolls
-    uchar c;
     char cleolkey = 0;           // FLAG: 0=non-cleol, 1=cleol
-    char cleolmode = 0;          // FLAG: 0=undo_save(), 1=undo_restore()
-    char *line = rs->history[0]; // history[0] is always "current line"
+    char compkey  = 0;           // FLAG: 1=TAB completed
+    char typed;                  // FLAG: 1=key types a char
+    char killkey  = 0;           // FLAG: 1=killed text
+    char yankkey  = 0;           // FLAG: 1=yanked
 
-    rs->curpos   = 0;            // current cursor position starts at 0
-    rs->hnav     = 0;
-    rs->lcanmode = 0;            // line cancel mode starts in save mode
-    rs->lcankey  = 0;            // line cancel key not hit yet
-    rs->histpos  = 0;            // reset history position to 0
-    line[0]      = 0;            // start with an empty line
+    STAT(rs, keys, 1);
+    rs->hnav    = 0;
+    rs->lcankey = 0;
 
-    while ( 1 ) {
-//DEBUG cursor_pos(0, 0);       // DEBUG
-//DEBUG show_history(rs);       // DEBUG
+    // Each key's edits are an undo step; a run of typed chars is one step,
+    // and so is a paste
+    //
+    typed = ( key >= ' ' && key < 0x100 && key != 0x7f ) || rs->literal;
+    if ( ! rs->pasting && ! (typed && rs->utyped) ) {
+        ++rs->ustep;
+        rs->ucur = rs->curpos;
+    }
+    rs->utyped = typed;
 
-        rs->hnav    = 0;
-        rs->lcankey = 0;
-        cleolkey = 0;
-        redraw_line(rs);
-        c = getch();
-        //cursor_pos(1,2); printf("GOTCHAR(%02x)\n", c);
+    // Handle literal (^V) mode right away
+    //     Whatever character user types next is inserted raw into line.
+    //
+    if ( rs->literal ) {
+        rs->literal = 0;            // first disable mode
+        append_char(rs, key);       // append raw character
+        goto post;
+    }
 
-        // Handle literal (^V) mode right away
-        //     Whatever character user types next is inserted raw into line.
-        //
-        if ( rs->literal ) {
-            rs->literal = 0;            // first disable mode
-            if ( c == 0 ) continue;     // not allowed for multi-code keys
-            append_char(rs, c);         // append raw character
-            goto post;
-        }
-again:
-        switch (c) {
-	    // MULTI-CODE TERMINAL KEYS (LINUX)
-	    case 0x1b:
-	        if ( (c=handle_esc(rs)) == 256 ) break; // handled
-		goto again;                             // not handled
-
-            // MULTI-CODE KEYS
-            case 0x00:
-                c = getch();
-                // cursor_pos(1,2); printf("GOTCHAR(%02x)\n", c);
-                switch (c) {
-                    case 0x3d: history_up(rs);               break; // F3
-                    case 0x4b: cursor_left(rs);              break; // LT ARROW
-                    case 0x4d: cursor_right(rs);             break; // RT ARROW
-                    case 0x48: history_up(rs);   rs->hnav=1; break; // UP ARROW
-                    case 0x50: history_down(rs); rs->hnav=1; break; // DN ARROW
-                    case 0x47: cursor_sol(rs);               break; // HOME
-                    case 0x4f: cursor_eol(rs);               break; // END
-                    case 0x53: delete_char(rs);              break; // DEL
-                    case 0x8d: history_top(rs);  rs->hnav=1; break; // CTRL-UP
-                    case 0x91: history_bot(rs);  rs->hnav=1; break; // CTRL-DOWN
-                    case 0x73: word_left(rs,0);              break; // CTRL-LT
-                    case 0x74: word_right(rs);               break; // CTRL-RT
-                }
-                break;
+    // Keys in ^R search mode narrow the search, until one ends it
+    if ( rs->searching && search_key(rs, key) ) goto post;
 
-            case 0x15:                          // ^U  -- line cancel/undo
-	        line_cancel(rs);
-                break;
+    // Pasted text goes in as is, rather than as editing keys
+    if ( rs->pasting && key < 0x100 ) {
+        char c = (char)key;
+        insert_str(rs, &c, 1);
+        goto post;
+    }
 
-            case 0x08: backspace(rs);   break;  // BACKSPACE
-            case 0x7f: delete_char(rs); break;  // CTRL-BACKSPACE (DEL)
-            // INS        -- enable/disable onscreen insert vs. overwrite mode
-            // Ctrl-RIGHT -- word right
-            // Ctrl-LEFT  -- word left
-            // Alt-num    -- enter extended PC graphics characters in decimal
-            // ^W         -- delete word left (del contiguous whitespace "word")
-            // Ctrl-DEL   -- delete word right
-            // ^L         -- clear screen, repaint current line
-            case '\r':
-            case '\n': enter_key(rs);                       // ENTER
-                       rs->prompty = save_py;
-                       return rs->history[0];
-            case 0x01: cursor_sol(rs);               break; // ^A / HOME
-            case 0x02: cursor_left(rs);              break; // ^B / LT ARROW
-            case 0x03:                               break; // ^C nop
-            case 0x04: delete_char(rs);              break; // ^D / DEL
-            case 0x05: cursor_eol(rs);               break; // ^E / END
-            case 0x06: cursor_right(rs);             break; // ^F / RT ARROW
-            case 0x0e: history_down(rs); rs->hnav=1; break; // ^N / DN ARROW
-            case 0x10: history_up(rs);   rs->hnav=1; break; // ^P / UP ARROW
-            case 0x16: rs->literal ^= 1;             break; // ^V literal char
-            case 0x0b:                                      // ^K clear to eol
-                if ( cleolmode == 0 ) { undo_save(rs); clear_eol(rs); }
-                else                  { undo_restore(rs); }
-                cleolmode ^= 1; // toggle between save/restore modes
-                cleolkey   = 1; // cleol key hit
-                break;
+    switch (key) {
+        // MULTI-CODE KEYS
+        case RL_KEY_PASTE_BEGIN: rs->pasting = 1;             break; // PASTE
+        case RL_KEY_PASTE_END:   rs->pasting = 0;             break;
+        case RL_KEY_F3:         history_up(rs);               break; // F3
+        case RL_KEY_LEFT:       cursor_left(rs);              break; // LT ARROW
+        case RL_KEY_RIGHT:      cursor_right(rs);             break; // RT ARROW
+        case RL_KEY_UP:         history_up(rs);   rs->hnav=1; break; // UP ARROW
+        case RL_KEY_DOWN:       history_down(rs); rs->hnav=1; break; // DN ARROW
+        case RL_KEY_HOME:       cursor_sol(rs);               break; // HOME
+        case RL_KEY_END:        cursor_eol(rs);               break; // END
+        case RL_KEY_DEL:        delete_char(rs);              break; // DEL
+        case RL_KEY_CTRL_UP:    history_top(rs);  rs->hnav=1; break; // CTRL-UP
+        case RL_KEY_CTRL_DOWN:  history_bot(rs);  rs->hnav=1; break; // CTRL-DOWN
+        case RL_KEY_CTRL_LEFT:  word_left(rs);                break; // CTRL-LT
+        case RL_KEY_CTRL_RIGHT: word_right(rs);               break; // CTRL-RT
+        case RL_KEY_CTRL_DEL:                                        // CTRL-DEL
+        case RL_KEY_ALT_D:                                           // ALT-D
+            kill_range(rs, rs->curpos, word_end(rs, rs->curpos), 0);
+            killkey = 1;
+            break;
+        case RL_KEY_ALT_Y:      yankkey = yank_pop(rs);       break; // ALT-Y
+
+        case 0x1b:                          // ESC -- line cancel/undo (DOS)
+            killkey = ! rs->lcanmode;
+            line_cancel(rs, rs->linelen);
+            break;
+        case 0x15:                          // ^U  -- kill to sol/undo
+            killkey = ! rs->lcanmode;
+            line_cancel(rs, rs->curpos);
+            break;
+
+        case 0x08: backspace(rs);   break;  // BACKSPACE
+        case 0x7f: delete_char(rs); break;  // CTRL-BACKSPACE (DEL)
+        // INS        -- enable/disable onscreen insert vs. overwrite mode
+        // Alt-num    -- enter extended PC graphics characters in decimal
+        // ^L         -- clear screen, repaint current line
+        case '\r':
+        case '\n': enter_key(rs);                       // ENTER
+                   rs->prompty   = rs->saveprompty;
+                   rs->lineready = 1;
+                   return;
+        case 0x01: cursor_sol(rs);               break; // ^A / HOME
+        case 0x02: cursor_left(rs);              break; // ^B / LT ARROW
+        case 0x03:                               break; // ^C nop
+        case 0x04: delete_char(rs);              break; // ^D / DEL
+        case 0x05: cursor_eol(rs);               break; // ^E / END
+        case 0x06: cursor_right(rs);             break; // ^F / RT ARROW
+        case 0x0e: history_down(rs); rs->hnav=1; break; // ^N / DN ARROW
+        case 0x10: history_up(rs);   rs->hnav=1; break; // ^P / UP ARROW
+        case 0x16: rs->literal ^= 1;             break; // ^V literal char
+        case 0x12: search_begin(rs);             break; // ^R reverse search
+        case 0x1f: undo(rs);                     break; // ^_ undo
+        case 0x1e: redo(rs);                     break; // ^^ redo
+        case 0x09:                                      // TAB complete
+            if ( ! rs->complete && rs->cwords == 0 ) { append_char(rs, key); break; }
+            complete_key(rs);
+            compkey = 1;
+            break;
+        case 0x0b:                                      // ^K kill to eol
+            if ( rs->cleolmode == 0 ) { kill_range(rs, rs->curpos, rs->linelen, 0);
+                                        killkey = 1; }
+            else                      { undo_last_key(rs); } // again: put back
+            rs->cleolmode ^= 1; // toggle between save/restore modes
+            cleolkey       = 1; // cleol key hit
+            break;
+        case 0x17:                                      // ^W kill word left
+            kill_range(rs, word_start(rs, rs->curpos), rs->curpos, 1);
+            killkey = 1;
+            break;
+        case 0x19: yankkey = yank(rs);           break; // ^Y yank
+
+        default:
+            // User typed some text, add it to string.
+            //    Ignore all unhandled ctrl codes except Tab.
+            //    If user wants to insert special chars (like ESC),
+            //    they can use ^V to do it, e.g. (^V) (ESC).
+            //
+            if ( key >= ' ' && key < 0x100 )
+                append_char(rs, key);
+            break;
+    }
+post:
+    // HISTORY NAVIGATION UNDO
+    //    Line shown is kept, and only copied if it gets edited.
+    //
+    if ( ! rs->hnav ) {
+        rs->histpos = -1;   // reset history pos unless navigating
+    }
+    // LINE CANCEL UNDO
+    if ( ! rs->lcankey ) {
+        rs->lcanmode = 0;       // reset to 'save' mode if not lcan key
+    }
+    // CLEOL UNDO
+    if ( ! cleolkey ) {
+        rs->cleolmode = 0;      // reset to 'save' mode if not cleol key
+    }
+    // COMPLETION LIST
+    if ( ! compkey ) {
+        rs->comptab = 0;        // other keys end completing
+        rs->listing = 0;
+    }
+    // KILL RING
+    rs->killkey = killkey;      // next kill joins this one
+    rs->yankkey = yankkey;      // Alt-Y next can swap what was yanked
+    // UTF-8
+    cursor_snap(rs);            // not inside a char the edit made
+}
+
+////       //////////////////////////////////////////////
+//// STATS //////////////////////////////////////////////
+////       //////////////////////////////////////////////
+
+#ifdef READLINE_STATS
+// RETURN A TIME IN MICROSECONDS
+Local long stat_usecs(void)
+{
+#ifdef LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+#else
+    return (long)(clock() * (1000000.0 / CLK_TCK));     // 55ms ticks
+#endif
+}
+
+// ADD KEY TO FLUSH TIME 'usecs' TO LATENCY HISTOGRAM
+Local void stat_latency(Readline *rs, long usecs)
+{
+    int i = 0;
+    while ( usecs > 0 && i < RL_LAT_BUCKETS-1 ) { usecs >>= 1; i++; }
+    ++rs->stats.lat[i];
+}
+#endif
 
-// COMMENTED OUT UNTIL word_left(rs,1) works properly
-// TODO:
-//     If cursor is on a space, hitting ^W cancels entire line
-//     because of how it hunts for a space/non-space.
-//     Change this so char delete happens AFTER new position detected.
-//     Maybe save curpos, do a word right, then do a delete_range()
-//     from saved pos to curpos.
+// GET STATS COUNTED SO FAR
+//    All zero unless readline.c was compiled with -DREADLINE_STATS.
 //
+Public void readline_stats(Readline *rs, ReadlineStats *out)
+{
+    *out = rs->stats;
+}
+
+// CLEAR STATS
+Public void readline_stats_reset(Readline *rs)
+{
+    memset(&rs->stats, 0, sizeof(rs->stats));
+}
+
+// START READING A LINE
+//    For apps driving readline from their own event loop: call this,
+//    then readline_feed() bytes from the terminal as they come in,
+//    until readline_line_ready() returns the line.
 //
-//          case 0x17: word_left(rs,1);  break;   // ^W delete word left
+Public void readline_begin(Readline *rs)
+{
+    rs->curpos    = 0;          // current cursor position starts at 0
+    rs->hnav      = 0;
+    rs->lcanmode  = 0;          // line cancel mode starts in save mode
+    rs->lcankey   = 0;          // line cancel key not hit yet
+    rs->cleolmode = 0;          // cleol mode starts in save mode
+    rs->killkey   = 0;          // nothing to join kills to, or swap yanks of
+    rs->yankkey   = 0;
+    rs->histpos   = -1;         // not navigating history
+    rs->searching = 0;
+    rs->literal   = 0;
+    rs->keylen    = 0;          // no partial key codes
+    rs->lineready = 0;
+    rs->pasting   = 0;
+    line_set(rs, "");           // start with an empty line
+    rs->viewstart = 0;
+    rs->ulogn     = 0;          // nothing to undo
+    rs->utop      = 0;
+    rs->ubytes    = 0;
+    rs->utyped    = 0;
+    rs->shadowlen = 0;          // screen unknown, first frame draws all
+    rs->drawnlen  = 0;
+    rs->frametop  = 0;
+    rs->term->begin(rs);
+    if ( rs->checksize ) check_size(rs);        // first line (or resized)
+    if ( rs->prompty < 0 ) rs->prompty = rs->scrn_h - 2;
+    rs->saveprompty = rs->prompty;  // save; we may adjust during scrolls
+    redraw_line(rs);
+    rs->term->flush(rs);
+}
 
-            default:
-                // User typed some text, add it to string.
-		//    Ignore all unhandled ctrl codes except Tab.
-		//    If user wants to insert special chars (like ESC),
-		//    they can use ^V to do it, e.g. (^V) (ESC).
-		//
-		if ( c == '\t' || c >= ' ' ) append_char(rs, c);
-                break;
+// FEED 'n' BYTES OF TERMINAL INPUT 'buf' TO THE LINE BEING READ
+//    Keys are handled as they're decoded; a key code split across
+//    calls is kept until the rest of it comes in. The line is redrawn
+//    once, after all the keys.
+//
+//    If readline_timeout() msecs pass with no input, call with 'n' of 0
+//    to say so, and a partial key code is taken as is (e.g. a lone ESC).
+// Returns:
+//    Number of bytes used. Stops after ENTER, leaving the rest
+//    of 'buf' for the next line.
+//
+Public int readline_feed(Readline *rs, const char *buf, int n)
+{
+    int i, used, key;
+    const char *esc;
+#ifdef READLINE_STATS
+    long t0 = stat_usecs(), k0 = rs->stats.keys;
+#endif
+
+    if ( rs->checksize ) check_size(rs);        // terminal resized?
+
+    if ( n == 0 ) {                             // timed out waiting for more
+        while ( rs->keylen && !rs->lineready ) {
+            used = key_decode(rs, &key, 1);
+            rs->keylen -= used;
+            memmove(rs->keybuf, rs->keybuf + used, rs->keylen);
+            if ( key >= 0 ) do_key(rs, key);
         }
-post:
-        // HISTORY NAVIGATION UNDO
-        if ( ! rs->hnav ) {
-            rs->histpos = 0;    // reset history pos unless navigating
+    }
+    for ( i=0; i<n && !rs->lineready; i++ ) {
+        // Pasting? Text up to the next ESC (maybe paste's end) goes in bulk
+        if ( rs->pasting && rs->keylen == 0 && !rs->searching && !rs->literal &&
+             buf[i] != 0x1b ) {
+            esc  = (const char*)memchr(buf + i, 0x1b, n - i);
+            used = esc ? (int)(esc - (buf + i)) : n - i;
+            insert_str(rs, buf + i, used);
+            STAT(rs, keys, used);                  // each char a key
+            rs->histpos   = -1;                 // as for any typed key
+            rs->lcanmode  = 0;
+            rs->cleolmode = 0;
+            rs->killkey   = 0;
+            rs->yankkey   = 0;
+            cursor_snap(rs);
+            i += used - 1;
+            continue;
+        }
+        // ^V: next byte goes in raw, even if it starts a key code
+        if ( rs->literal && rs->keylen == 0 ) {
+            if ( buf[i] == 0 ) rs->literal = 0;     // not allowed for multi-code keys
+            else               do_key(rs, (uchar)buf[i]);
+            continue;
+        }
+        rs->keybuf[rs->keylen++] = buf[i];
+        while ( rs->keylen && (used = key_decode(rs, &key, 0)) > 0 ) {
+            rs->keylen -= used;
+            memmove(rs->keybuf, rs->keybuf + used, rs->keylen);
+            if ( key >= 0 ) do_key(rs, key);
+        }
+    }
+    if ( ! rs->lineready ) {
+        redraw_line(rs);
+        rs->term->flush(rs);
+    }
+#ifdef READLINE_STATS
+    if ( rs->stats.keys != k0 )                 // time keys to their frame
+        stat_latency(rs, stat_usecs() - t0);
+#endif
+    return i;
+}
+
+// RETURN MSECS TO WAIT FOR MORE INPUT BEFORE readline_feed(rs, NULL, 0)
+//    -1 if there's nothing to wait for.
+//
+Public int readline_timeout(Readline *rs)
+{
+    return rs->keylen ? rs->esctimeout : -1;
+}
+
+// RETURN LINE IF USER HIT ENTER, ELSE NULL
+Public char* readline_line_ready(Readline *rs)
+{
+    return rs->lineready ? line_str(rs) : 0;
+}
+
+// Read a line from the user
+//     Handles line editing, command history.
+//     At end of input (EOF), ENTER ends whatever's been typed.
+// Returns:
+//     The line, or NULL at end of input with nothing typed
+//
+Public char* readline(Readline *rs)
+{
+    int empty;
+    readline_begin(rs);
+    while ( 1 ) {
+        // Feed typeahead, reading what's waiting when we run out.
+        //    Input after ENTER is kept for the next line.
+        //
+        if ( rs->inpos == rs->inlen ) {
+            rs->inpos = 0;
+            rs->inlen = rs->term->read(rs, rs->inbuf, INBUF_SIZE,
+                                       readline_timeout(rs));
         }
-        // LINE CANCEL UNDO
-        if ( ! rs->lcankey ) {
-            rs->lcanmode = 0;       // reset to 'save' mode if not lcan key
+        if ( rs->inlen == RL_READ_WOKEN ) {     // resized? not a timeout:
+            rs->inlen = 0;                      //    keep partial key code
+            if ( rs->checksize ) check_size(rs);
+            redraw_line(rs);
+            rs->term->flush(rs);
+            continue;
         }
-        // CLEOL UNDO
-        if ( ! cleolkey ) {
-            cleolmode = 0;      // reset to 'save' mode if not cleol key
+        if ( rs->inlen < 0 ) {                  // EOF: ENTER ends the line
+            rs->inlen   = 0;
+            rs->keylen  = 0;                    // (so it's taken as ENTER,
+            rs->pasting = 0;                    //  not part of a key, paste
+            rs->literal = 0;                    //  or ^V)
+            empty = ( rs->linelen == 0 );
+            readline_feed(rs, "\r", 1);
+            return empty ? 0 : line_str(rs);
         }
+        rs->inpos += readline_feed(rs, rs->inbuf + rs->inpos,
+                                   rs->inlen - rs->inpos);
+        if ( rs->lineready ) return line_str(rs);
     }
 }
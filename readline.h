@@ -12,28 +12,295 @@
   #include "public.h"	// Public..
 #endif
 
-// Struct to manage readline history
+// Key codes for multi-code keys, past the single byte chars
+//    (see readline_bind())
+#define RL_KEY_UP          0x100
+#define RL_KEY_DOWN        0x101
+#define RL_KEY_LEFT        0x102
+#define RL_KEY_RIGHT       0x103
+#define RL_KEY_HOME        0x104
+#define RL_KEY_END         0x105
+#define RL_KEY_DEL         0x106
+#define RL_KEY_CTRL_UP     0x107
+#define RL_KEY_CTRL_DOWN   0x108
+#define RL_KEY_CTRL_LEFT   0x109
+#define RL_KEY_CTRL_RIGHT  0x10a
+#define RL_KEY_F3          0x10b
+#define RL_KEY_PASTE_BEGIN 0x10c   // bracketed paste: ESC[200~
+#define RL_KEY_PASTE_END   0x10d   //                  ESC[201~
+#define RL_KEY_CTRL_DEL    0x10e
+#define RL_KEY_ALT_D       0x10f
+#define RL_KEY_ALT_Y       0x110
+
+// Node of key decoder's trie of key code sequences
+typedef struct {
+    char c;             // byte this node matches
+    int key;            // key, if sequence ends here (-1=none)
+    int child;          // first node for next byte (0=none)
+    int next;           // next node for another byte at this point (0=none)
+} RLKeyNode;
+
+// Kill ring: most recent kills kept for yanking back (^Y, Alt-Y)
+#define RL_KILL_RING 8
+
+// Counters kept if readline.c is compiled with -DREADLINE_STATS
+//    (see readline_stats())
+#define RL_LAT_BUCKETS 20
+typedef struct {
+    long keys;          // keys handled
+    long frames;        // frames drawn by redraw_line()
+    long bytes;         // bytes written to the terminal (ANSI)
+    long cells;         // cells plotted
+    long pushes;        // lines pushed into history
+    long moved;         // bytes memmove()d moving the line's gap
+    long lat[RL_LAT_BUCKETS];   // key to frame flush times: lat[0] is
+                        // under 1 usec, lat[i] under 2^i usecs, last is rest
+} ReadlineStats;
+
+struct Readline;
+
+// term->read() returns, besides a count of bytes read
+#define RL_READ_EOF   (-1)  // end of input (EOF or error)
+#define RL_READ_WOKEN (-2)  // woke up with no keys (e.g. terminal resized)
+
+// Terminal backend: how readline talks to the screen and keyboard
+//    rs->term points to one of these (see readline_term_xxx()),
+//    rs->termdata is for its own use. Positions are zero based.
+//
+typedef struct {
+    // Read keys waiting (at least one) into buf, returning how many.
+    // Gives up after 'timeout' msecs (-1=wait forever), returning 0.
+    // Can return RL_READ_WOKEN early, e.g. after setting rs->checksize;
+    // unlike a timeout, that leaves a partly read key code waiting.
+    // Returns RL_READ_EOF at end of input (EOF or error).
+    int  (*read)(struct Readline *rs, char *buf, int size, int timeout);
+    // Put 'n' bytes of chars at x,y, all on that row (UTF-8 if rs->utf8,
+    // where wide chars take two cells)
+    void (*put)(struct Readline *rs, int x, int y, const char *s, int n);
+    // Move cursor to x,y
+    void (*move)(struct Readline *rs, int x, int y);
+    // Blank x,y thru ex,ey (can blank on to the end of the row/screen)
+    void (*clear)(struct Readline *rs, int x, int y, int ex, int ey);
+    // Scroll screen up 'lines' lines
+    void (*scroll)(struct Readline *rs, int lines);
+    // Send out whatever's been drawn; called once per frame
+    void (*flush)(struct Readline *rs);
+    // Reading a line starts, and is done
+    void (*begin)(struct Readline *rs);
+    void (*end)(struct Readline *rs);
+    // Get screen's size into *w,*h; returns 0 if it can't tell
+    int  (*size)(struct Readline *rs, int *w, int *h);
+} ReadlineTerm;
+
+// In-memory screen for readline_term_mem(), for tests and benchmarks
 typedef struct {
+    char *cells;        // w*h chars, row by row (app allocates; UTF-8
+                        // chars show as '?', wide ones as "? ")
+    int w, h;           // size of screen
+    int curx, cury;     // cursor position
+    const char *in;     // keys to read (app sets)
+    int inlen;          // bytes in 'in'
+    int inpos;          // bytes of 'in' read so far
+    long cellsput;      // cells put so far
+    long flushes;       // frames flushed so far
+} RLMemTerm;
+
+// Postings list for ^R search index
+typedef struct {
+    long *seq;          // seqs of history lines with a trigram, oldest first
+    int len;            // postings in list
+    int size;           // allocated size of list
+} RLPost;
+
+// Edit in undo log: at 'pos', 'del' chars removed, 'ins' chars inserted
+typedef struct {
+    int pos;            // line position of edit
+    int del;            // chars removed..
+    int ins;            // ..and inserted (ubuf+off has them, in that order)
+    int cur;            // cursor before the step
+    long off;           // ubuf offset of chars
+    long step;          // edits of a step are undone together
+} RLUndo;
+
+// Entry of history's duplicate line hash table
+typedef struct {
+    long seq;           // seq of history entry (-1=empty)
+    unsigned long hash; // hash of its line
+} RLDup;
+
+// Node of history's prefix index, a treap keyed by (line, seq)
+typedef struct {
+    long seq;           // seq of history entry
+    int left, right;    // children (history slots, -1=none)
+    long max;           // newest seq in subtree not hidden (-1=none)
+    char hidden;        // FLAG: 1=prefix nav has shown it already
+} RLSortNode;
+
+// App's tab completer: return candidate 'i' (0,1,2..) for 'word' of 'len'
+//    chars, or 0 when there are no more. Strings returned must stay put
+//    while the line is being read.
+//
+typedef const char* (*ReadlineComplete)(struct Readline *rs, const char *word,
+                                        int len, long i);
+
+// Struct to manage readline history
+typedef struct Readline {
     int maxline;        // maximum line size
     int histsize;       // maximum history size
-    char **history;     // history array
-    int histpos;        // current up/down history position
-    char *histsave;	// saved ptr for edit line during history nav
-    char *undoline;     // copy of line used for 1 level undo
-    int undocurpos;     // cursor position at time of undo save
+    char *harena;       // history lines, packed NULL terminated
+    long hbytes;        // size of harena (history's byte budget)
+    long htail;         // harena offset where next history line goes
+    long hused;         // bytes of harena holding lines
+    long *hoff;         // harena offset of entry 'seq' is hoff[seq % histsize]
+    int *hlen;          // length of entry 'seq' is hlen[seq % histsize]
+    char *histfile;     // if set, lines entered are appended to this file
+    long histfilemax;   // compact histfile past this many bytes (0=2*hbytes)
+    long histfilesize;  // histfile's size, as far as we know
+    long histfirst;     // seq of oldest history entry
+    long histnext;      // seq the next history entry gets
+    long histpos;       // seq of entry during up/down history nav (-1=none)
+    long histbase;      // seq of line shown when nav began (-1=edit buffer)
+    long lineseq;       // seq of history entry line is showing (-1=editbuf)
+    // Duplicate history lines
+    char histnodups;    // FLAG: 1=a line entered again moves to newest,
+                        //       rather than adding a copy (caller can set)
+    RLDup *hdup;        // hash table of history lines (0=not built yet)
+    long hdupmask;      // hash table size-1 (size is a power of 2)
+    // Prefix history nav
+    char histprefix;    // FLAG: 1=up/down only show lines starting with
+                        //       text before cursor (caller can set)
+    RLSortNode *hsort;  // prefix index, a node per history slot (0=not built yet)
+    int hsortroot;      // root of the index (-1=empty)
+    long *navmatch;     // seqs of lines prefix nav has shown, newest first
+    long navidx;        // entries in navmatch (last is the one shown)
+    char *navpfx;       // prefix nav is matching
+    int navprefix;      // length of prefix nav is matching (0=not filtering)
+    // ^R reverse search
+    char searching;     // FLAG: 1=in ^R search
+    char *srchpat;      // search pattern
+    int srchlen;        // length of search pattern
+    long srchmatch;     // seq of line matched (-1=none yet)
+    long srchbase;      // lineseq when search began (^G returns to it)
+    char *srchprompt;   // prompt shown during search
+    char *srchsave;     // app's prompt, put back after search
+    RLPost *srchidx;    // trigram index of history (SRCH_BUCKETS lists)
+    char *line;         // line being edited: editbuf, or history entry shown
+    char *editbuf;      // edit buffer (gap buffer)
+    int editlen;        // editbuf's length while a history entry is shown
+    RLUndo *ulog;       // undo log of edits, oldest first
+    int ulogn;          // edits in ulog
+    int ulogsize;       // allocated size of ulog
+    int utop;           // edits in effect (ulogn-utop can be redone)
+    char *ubuf;         // chars removed and inserted by edits in ulog
+    long ubytes;        // bytes of ubuf used
+    long usize;         // allocated size of ubuf
+    long ustep;         // undo step edits are now logged as
+    int ucur;           // cursor position when step began
+    char utyped;        // FLAG: 1=last key typed a char (typing merges)
+    char *killbuf;      // kill ring's text, oldest kill first
+    long killsize;      // size of killbuf
+    long killused;      // bytes of killbuf used
+    long killoff[RL_KILL_RING]; // killbuf offsets of kills..
+    int killlen[RL_KILL_RING];  // ..and their lengths
+    int killn;          // kills in ring
+    int killyank;       // kill last yanked
+    int yankpos;        // line position of text yanked..
+    int yanklen;        // ..and its length
+    char killkey;       // FLAG: 1=last key killed text (next kill joins it)
+    char yankkey;       // FLAG: 1=last key yanked (Alt-Y can swap it)
     int curpos;         // current cursor position
+    int linelen;        // length of line being edited
+    int gapstart;       // line's gap buffer: start of gap
+    int gapend;         // line's gap buffer: end of gap (text follows)
+    char linehigh;      // FLAG: 1=line may have non-ASCII bytes (UTF-8 chars)
     int promptx;        // prompt's X position on screen (0 based)
     int prompty;        // prompt's Y position on screen (0 based)
+    int frametop;       // rows of frame scrolled off the top (line taller than screen)
     char *prompt;       // prompt string
     int cursorx;        // onscreen cursor X position (0 based)
     int cursory;        // onscreen cursor Y position (0 based)
     int literal;        // 0|1 flag: =1 if ^V literal mode
     int scrn_w;         // screen width (default 80)
-    int scrn_h;         // screen width (default 25)
+    int scrn_h;         // screen height (default 25)
+    char termsize;      // FLAG: 1=scrn_w/h follow terminal's size (caller can clear)
+    char checksize;     // FLAG: 1=ask terminal its size before next frame
     char hnav;          // FLAG: 1=history nav, 0=not hnav
     // linecancel flags
-    char lcanmode;      // FLAG: 0=undo_save(), 1=undo_restore()
+    char lcanmode;      // FLAG: 0=clear line, 1=undo it (^U, ESC)
     char lcankey;       // FLAG: 0=non-line cancel, 1=lcan key
+    char cleolmode;     // FLAG: 0=clear to eol, 1=undo it (^K)
+    // event driven input (readline_begin/feed)
+    char keybuf[8];     // bytes of a key code not all in yet
+    int keylen;         // bytes in keybuf
+    RLKeyNode *keytrie; // key decoder's trie, keytrie[0] is root
+    int keynodes;       // nodes in use in keytrie
+    int keytriesize;    // allocated nodes in keytrie
+    int esctimeout;     // msecs to wait for rest of ESC key (caller can set)
+    char lineready;     // FLAG: 1=user hit ENTER, line done
+    int saveprompty;    // prompty when line began
+    char pasting;       // FLAG: 1=in a bracketed paste
+    char *inbuf;        // typeahead read by readline(), not yet fed
+    int inlen;          // bytes in inbuf
+    int inpos;          // bytes of inbuf fed so far
+    // instrumentation
+    ReadlineStats stats; // counters (only counted with -DREADLINE_STATS)
+    // terminal
+    const ReadlineTerm *term; // terminal backend (caller can set)
+    void *termdata;     // backend's data (e.g. RLMemTerm)
+    int infd;           // ANSI backend: read keys from this fd (default 0)
+    int outfd;          // ANSI backend: write to this fd (default 1)
+    char keepraw;       // FLAG: 1=tty stays raw between lines (caller can set)
+    char utf8;          // FLAG: 1=line and prompt are UTF-8 (default on LINUX,
+                        //       caller can set)
+    char *span;         // chars collected for next term->put()
+    int spanx, spany;   // where span goes
+    int spanlen;        // bytes in span
+    int spancells;      // cells they take
+    // output buffering (ANSI)
+    char *outbuf;       // terminal output buffer, flushed once per frame
+    int outsize;        // size of outbuf
+    int outlen;         // bytes currently in outbuf
+    int outx;           // terminal's cursor X position (-1 if unknown)
+    int outy;           // terminal's cursor Y position (-1 if unknown)
+    long framebytes;    // bytes written to terminal by last frame
+    // shadow screen
+    long *shadow;       // cells last drawn, starting at promptx,prompty:
+                        //    code point (or char), or CELL_xxx
+    int shadowsize;     // size of shadow
+    int shadowlen;      // cells of shadow known to be on screen
+    int drawnlen;       // cells used by last frame (prompt+line)
+    // layout cache
+    int *cols;          // cols[i]: cell index of line char i (maxline+1)
+    int colvalid;       // cols[0..colvalid-1] are up to date
+    int dirty;          // line changed from this position since last frame
+    char *layprompt;    // prompt the layout was computed for
+    int laypromptx;     // promptx the layout was computed for
+    int layscrn_w;      // scrn_w the layout was computed for
+    // sideways scrolling
+    char hscroll;       // FLAG: 1=keep line on one row, scrolling sideways
+                        //       with the cursor (caller can set)
+    int viewstart;      // hscroll: first line char in view
+    // tab completion
+    ReadlineComplete complete;  // app's completer (0=candidate store)
+    void *compdata;     // for app's completer's use
+    char *carena;       // candidate store: words, NULL terminated
+    long cbytes;        // bytes of carena used
+    long csize;         // allocated size of carena
+    long *cword;        // carena offsets of words (sorted if csorted)
+    long cwords;        // words in store
+    long cwordsize;     // allocated size of cword
+    char csorted;       // FLAG: 1=cword sorted, no duplicates
+    char *compword;     // word being completed
+    int compwordlen;    // its length
+    long compn;         // candidates for it
+    long complo;        // store: cword index of first candidate
+    char comptab;       // FLAG: 1=last TAB had nothing to add
+    char listing;       // FLAG: 1=candidates listed below line
+    long listpos;       // first candidate on page listed
+    long listn;         // candidates on page
+    int listrows;       // page's rows of candidates
+    int listcols;       // page's columns..
+    int listcolw;       // ..and their width
 } Readline;
 
 #include "readline.pro"
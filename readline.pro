@@ -1,6 +1,25 @@
 // Prototypes
 Public Readline* MakeReadline(int maxline,int histsize);
 Public void FreeReadline(Readline *rs);
+Public int readline_rawmode(Readline *rs, int on);
+Public const ReadlineTerm* readline_term_ansi(void);
+Public const ReadlineTerm* readline_term_dos(void);
+Public const ReadlineTerm* readline_term_mem(void);
+Public void readline_resize(Readline *rs, int w, int h);
+Public void readline_history_add(Readline *rs, const char *s);
+Public int readline_history_budget(Readline *rs, long bytes);
+Public long readline_history_mem(Readline *rs, long *used);
 Public void show_history(Readline *rs);
+Public int readline_history_load(Readline *rs, const char *filename);
+Public int readline_history_save(Readline *rs, const char *filename);
+Public int readline_complete_add(Readline *rs, const char **words, long n);
+Public void readline_complete_clear(Readline *rs);
+Public int readline_bind(Readline *rs, const char *seq, int len, int key);
+Public void readline_stats(Readline *rs, ReadlineStats *out);
+Public void readline_stats_reset(Readline *rs);
+Public void readline_begin(Readline *rs);
+Public int readline_feed(Readline *rs, const char *buf, int n);
+Public int readline_timeout(Readline *rs);
+Public char* readline_line_ready(Readline *rs);
 Public char* readline(Readline *rs);
 
@@ -9,29 +9,66 @@
 
 // #include "regress1.c"   // regression tests
 
+// LINE TALLER THAN SCREEN: PROMPT AND CURSOR MUST STAY ON IT
+//    Pastes 2500 chars at the bottom of an 80x25 in-memory screen,
+//    then homes the cursor and hits ENTER.
+//
+void RegressionTest_tall_line()
+{
+    static char cells[80*25];
+    char paste[2520], *s;
+    RLMemTerm m;
+    Readline *rs = MakeReadline(4096, 5);
+    int t, ok = 1;
+
+    memset(cells, ' ', sizeof(cells));
+    memset(&m, 0, sizeof(m));
+    m.cells = cells;
+    m.w = 80;
+    m.h = 25;
+    rs->term     = readline_term_mem();
+    rs->termdata = &m;
+    rs->prompt   = "My Prompt>";
+    rs->prompty  = 24;                  // prompt on bottom row
+    readline_begin(rs);
+
+    strcpy(paste, "\033[200~");
+    for ( t=0; t<2500; t++ ) paste[6+t] = 'a' + t % 26;
+    strcpy(paste+2506, "\033[201~");
+    readline_feed(rs, paste, 2512);
+    if ( rs->prompty < 0 || m.cury < 0 || m.cury >= m.h ) ok = 0;
+    if ( m.cury != m.h-1 ) ok = 0;      // end of line on bottom row
+
+    readline_feed(rs, "\001", 1);       // ^A: cursor to start of line
+    if ( rs->prompty != 0 || m.cury != 0 || m.curx != 10 ) ok = 0;
+
+    readline_feed(rs, "\r", 1);
+    s = readline_line_ready(rs);
+    if ( s == NULL || strlen(s) != 2500 || s[2499] != 'a' + 2499 % 26 ) ok = 0;
+    printf("RegressionTest_tall_line: %s\n", ok ? "ok" : "FAILED");
+    FreeReadline(rs);
+}
+
 int main()
 {
+    char *s;
+    Readline *rs;
     // RegressionTest_delete_char();
     // RegressionTest_insert_char();
-    char *s;
-    Readline *rs = MakeReadline(255, 5);
+    RegressionTest_tall_line();
+    rs = MakeReadline(255, 5);
     rs->prompt = "My Prompt>";
-    strcpy(rs->history[0], "aaa");
-    strcpy(rs->history[1], "bbb");
-    strcpy(rs->history[2], "ccc");
-    strcpy(rs->history[3], "ddd");
-    strcpy(rs->history[4], "eee");
+    readline_history_add(rs, "aaa");
+    readline_history_add(rs, "bbb");
+    readline_history_add(rs, "ccc");
+    readline_history_add(rs, "ddd");
+    readline_history_add(rs, "eee");
     printf("\033[2J\033[0;0H");  // cls, cursor to top
     show_history(rs);
     printf("Calling readline()..\n");
-#ifdef LINUX
-    system("stty raw -echo");
-#endif
-    s = readline(rs);
-#ifdef LINUX
-    system("stty -raw echo");
-#endif
-    printf("\rGOT: '%s'\n", s);
+    s = readline(rs);           // puts tty in raw mode while it reads
+    if ( s == NULL ) printf("\rGOT: EOF\n");
+    else             printf("\rGOT: '%s'\n", s);
     show_history(rs);
     return 0;
 }